@@ -0,0 +1,509 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// bench builds indexes over dense vectors for every combination of the
+// parameters given on the command line, and measures build time, memory,
+// query throughput and latency, and recall against brute force.
+//
+// Data is either generated from a seed, so that runs are reproducible, or
+// read from an .fvecs file. Queries are never inserted: synthetic queries
+// are drawn from the same clusters as the points, and the last -queries
+// vectors of a file are held out as queries.
+//
+// Results are printed one line per configuration and, with -out, written
+// as JSON for comparing builds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "lsh.h"
+#include "slsh.h"
+#include "fastslsh.h"
+#include "quantizedslsh.h"
+#include "simhash.h"
+#include "densevector.h"
+#include "parallel.h"
+
+struct options {
+	std::vector<size_t> n;
+	std::vector<int> d;
+	std::vector<int> k;
+	std::vector<int> L;
+	std::vector<int> limit;
+	std::vector<int> threads;
+	std::vector<int> probes;
+	std::vector<std::string> hashers;
+	size_t queries;
+	unsigned int seed;
+	size_t clusterSize;  // average number of points per cluster of synthetic data.
+	float noise;  // standard deviation of synthetic points around their cluster center.
+	const char *data;  // .fvecs file to read instead of generating data.
+	const char *out;  // JSON output file.
+};
+
+// Vectors of dimension d, in row-major order.
+struct dataset {
+	std::string name;
+	int d;
+	size_t n;
+	std::vector<float> points;
+	std::vector<float> queries;
+};
+
+static void usage() {
+	fprintf(stderr,
+		"usage: bench [options]\n"
+		"Comma separated lists are swept over.\n"
+		"  -n LIST        number of points (default 100000)\n"
+		"  -d LIST        dimension of synthetic data (default 128)\n"
+		"  -k LIST        elementary hashes per table (default 2)\n"
+		"  -L LIST        tables (default 4)\n"
+		"  -limit LIST    neighbors per query, the k of recall@k (default 10)\n"
+		"  -threads LIST  threads for building and querying (default 1)\n"
+		"  -probes LIST   buckets probed per table (default 1)\n"
+		"  -hasher LIST   slsh, fastslsh, qslsh, simhash (default slsh)\n"
+		"  -queries N     number of queries (default 1000)\n"
+		"  -seed N        seed for data and hashers (default 1)\n"
+		"  -cluster N     points per cluster of synthetic data (default 20)\n"
+		"  -noise X       spread of synthetic clusters (default 0.3)\n"
+		"  -data FILE     read points from an .fvecs file\n"
+		"  -out FILE      write results as JSON\n");
+	exit(2);
+}
+
+template <class T>
+static std::vector<T> parseList(const char *s) {
+	std::vector<T> v;
+	while (*s) {
+		char *end;
+		v.push_back((T)strtod(s, &end));
+		if (end == s || (*end != ',' && *end != 0)) {
+			usage();
+		}
+		s = *end == ',' ? end + 1 : end;
+	}
+	return v;
+}
+
+static std::vector<std::string> parseNames(const char *s) {
+	std::vector<std::string> v;
+	std::string all(s);
+	size_t at = 0;
+	while (at <= all.size()) {
+		size_t comma = all.find(',', at);
+		if (comma == std::string::npos) {
+			comma = all.size();
+		}
+		v.push_back(all.substr(at, comma - at));
+		at = comma + 1;
+	}
+	return v;
+}
+
+static options parseOptions(int argc, char **argv) {
+	options o;
+	o.n.push_back(100000);
+	o.d.push_back(128);
+	o.k.push_back(2);
+	o.L.push_back(4);
+	o.limit.push_back(10);
+	o.threads.push_back(1);
+	o.probes.push_back(1);
+	o.hashers.push_back("slsh");
+	o.queries = 1000;
+	o.seed = 1;
+	o.clusterSize = 20;
+	o.noise = 0.3f;
+	o.data = nullptr;
+	o.out = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+		const char *name = argv[i];
+		if (i+1 == argc) {
+			usage();
+		}
+		const char *value = argv[++i];
+		if (strcmp(name, "-n") == 0) {
+			o.n = parseList<size_t>(value);
+		} else if (strcmp(name, "-d") == 0) {
+			o.d = parseList<int>(value);
+		} else if (strcmp(name, "-k") == 0) {
+			o.k = parseList<int>(value);
+		} else if (strcmp(name, "-L") == 0) {
+			o.L = parseList<int>(value);
+		} else if (strcmp(name, "-limit") == 0) {
+			o.limit = parseList<int>(value);
+		} else if (strcmp(name, "-threads") == 0) {
+			o.threads = parseList<int>(value);
+		} else if (strcmp(name, "-probes") == 0) {
+			o.probes = parseList<int>(value);
+		} else if (strcmp(name, "-hasher") == 0) {
+			o.hashers = parseNames(value);
+		} else if (strcmp(name, "-queries") == 0) {
+			o.queries = (size_t)atol(value);
+		} else if (strcmp(name, "-seed") == 0) {
+			o.seed = (unsigned int)atol(value);
+		} else if (strcmp(name, "-cluster") == 0) {
+			o.clusterSize = (size_t)atol(value);
+		} else if (strcmp(name, "-noise") == 0) {
+			o.noise = (float)atof(value);
+		} else if (strcmp(name, "-data") == 0) {
+			o.data = value;
+		} else if (strcmp(name, "-out") == 0) {
+			o.out = value;
+		} else {
+			usage();
+		}
+	}
+
+	for (auto &h: o.hashers) {
+		if (h != "slsh" && h != "fastslsh" && h != "qslsh" && h != "simhash") {
+			usage();
+		}
+	}
+	if (o.queries == 0 || o.clusterSize == 0) {
+		usage();
+	}
+	return o;
+}
+
+static double now() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+}
+
+// Generates n points and nq queries of dimension d around n/clusterSize
+// random centers. The result only depends on the arguments.
+static dataset synthetic(size_t n, int d, size_t nq, unsigned int seed, size_t clusterSize, float noise) {
+	std::mt19937_64 generator(seed);
+	std::normal_distribution<float> normal(0.0f, 1.0f);
+	size_t nCenters = n/clusterSize > 0 ? n/clusterSize : 1;
+	std::vector<float> centers(nCenters*d);
+	for (size_t i = 0; i < centers.size(); i++) {
+		centers[i] = normal(generator);
+	}
+
+	dataset s;
+	s.name = "synthetic";
+	s.d = d;
+	s.n = n;
+	s.points.resize(n*d);
+	s.queries.resize(nq*d);
+	for (size_t i = 0; i < n + nq; i++) {
+		const float *c = &centers[(generator() % nCenters)*d];
+		float *x = i < n ? &s.points[i*d] : &s.queries[(i-n)*d];
+		for (int j = 0; j < d; j++) {
+			x[j] = c[j] + noise*normal(generator);
+		}
+	}
+	return s;
+}
+
+// Reads an .fvecs file, in which every vector is its dimension as a 32-bit
+// integer followed by as many floats. The last nq vectors become queries.
+static bool readFvecs(const char *path, size_t nq, dataset *s) {
+	FILE *f = fopen(path, "rb");
+	if (f == nullptr) {
+		perror(path);
+		return false;
+	}
+	s->name = path;
+	s->d = 0;
+	std::vector<float> all;
+	int32_t d;
+	while (fread(&d, sizeof(d), 1, f) == 1) {
+		if (d <= 0 || (s->d != 0 && d != s->d)) {
+			fprintf(stderr, "%s: bad dimension %d\n", path, d);
+			fclose(f);
+			return false;
+		}
+		s->d = d;
+		size_t at = all.size();
+		all.resize(at + d);
+		if (fread(&all[at], sizeof(float), d, f) != (size_t)d) {
+			fprintf(stderr, "%s: truncated\n", path);
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+
+	size_t total = s->d > 0 ? all.size()/s->d : 0;
+	if (total <= nq) {
+		fprintf(stderr, "%s: %llu vectors, need more than %llu\n", path, (unsigned long long)total, (unsigned long long)nq);
+		return false;
+	}
+	s->n = total - nq;
+	s->points.assign(all.begin(), all.begin() + s->n*s->d);
+	s->queries.assign(all.begin() + s->n*s->d, all.end());
+	return true;
+}
+
+// Returns the vectors of x, of dimension d, padded with zeros to dimension D.
+template <int D>
+static std::vector<DenseVector<D> > pad(const std::vector<float> &x, int d, size_t n) {
+	std::vector<DenseVector<D> > vs;
+	vs.reserve(n);
+	float y[D] = {0};
+	for (size_t i = 0; i < n; i++) {
+		memcpy(y, &x[i*d], d*sizeof(float));
+		vs.push_back(DenseVector<D>(y));
+	}
+	return vs;
+}
+
+// Writes one configuration and its measurements as JSON and as a line of text.
+struct result {
+	std::string dataset;
+	std::string hasher;
+	size_t n;
+	int d, k, L, limit, threads, probes;
+	size_t queries;
+	double buildSeconds;
+	double indexBytesPerPoint;
+	double hasherBytes;
+	double qps;
+	double p50, p99, p999;  // latencies in microseconds.
+	double recall;
+	double candidates;  // average number of points in the buckets probed.
+
+	void print(FILE *json, bool first) const {
+		printf("%-9s n=%-8llu d=%-4d k=%-2d L=%-3d limit=%-3d threads=%-2d probes=%-3d build=%.3fs %.1fB/pt qps=%.0f p50=%.1fus p99=%.1fus p999=%.1fus recall=%.4f candidates=%.1f\n",
+			this->hasher.c_str(), (unsigned long long)this->n, this->d, this->k, this->L, this->limit, this->threads, this->probes,
+			this->buildSeconds, this->indexBytesPerPoint, this->qps, this->p50, this->p99, this->p999, this->recall, this->candidates);
+		fflush(stdout);
+		if (json == nullptr) {
+			return;
+		}
+		fprintf(json, "%s\n    {\"dataset\": \"%s\", \"hasher\": \"%s\", \"n\": %llu, \"d\": %d, \"k\": %d, \"L\": %d, \"limit\": %d, \"threads\": %d, \"probes\": %d, \"queries\": %llu,\n"
+			"     \"build_seconds\": %.6f, \"index_bytes_per_point\": %.2f, \"hasher_bytes\": %.0f, \"qps\": %.2f,\n"
+			"     \"latency_us\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f}, \"recall\": %.6f, \"candidates\": %.3f}",
+			first ? "" : ",", this->dataset.c_str(), this->hasher.c_str(), (unsigned long long)this->n, this->d, this->k, this->L,
+			this->limit, this->threads, this->probes, (unsigned long long)this->queries,
+			this->buildSeconds, this->indexBytesPerPoint, this->hasherBytes, this->qps,
+			this->p50, this->p99, this->p999, this->recall, this->candidates);
+	}
+};
+
+// Returns the q-quantile of sorted.
+static double quantile(const std::vector<double> &sorted, double q) {
+	return sorted[(size_t)(q*(double)(sorted.size() - 1))];
+}
+
+// Runs every configuration of one dataset, with the hasher fixed.
+template <int D, class Hasher>
+static void sweep(const options &o, const dataset &s, const std::vector<DenseVector<D> > &points,
+	const std::vector<DenseVector<D> > &queries, const std::vector<std::vector<slash::Neighbor> > &truth,
+	const char *hasherName, FILE *json, bool *first) {
+	typedef DenseVector<D> Vector;
+	size_t nq = queries.size();
+
+	for (int k: o.k) {
+		for (int L: o.L) {
+			for (int threads: o.threads) {
+				// Hashers draw their rotations from rand.
+				srand(o.seed);
+				Hasher *hasher = new Hasher(D, k, L);
+				slash::LSH<Vector, Hasher> *index = new slash::LSH<Vector, Hasher>(D, k, L, hasher);
+				index->SetThreads(threads);
+				double start = now();
+				index->Insert(points);
+				index->Freeze();
+				double buildSeconds = now() - start;
+
+				for (int limit: o.limit) {
+					for (int probes: o.probes) {
+						index->SetProbes(probes);
+						std::vector<double> latencies(nq);
+						std::vector<std::vector<slash::Neighbor> > found(nq);
+						std::vector<slash::QueryStats> stats(nq);
+						int nThreads = slash::threadCount(threads);
+
+						for (size_t i = 0; i < nq && i < 100; i++) {  // warm up.
+							index->Query(queries[i], limit);
+						}
+						start = now();
+						slash::parallelFor(nThreads, nq, [&](size_t begin, size_t end) {
+							for (size_t i = begin; i < end; i++) {
+								double t = now();
+								found[i] = index->Query(queries[i], limit, &stats[i]);
+								latencies[i] = 1e6*(now() - t);
+							}
+						});
+						double wall = now() - start;
+						std::sort(latencies.begin(), latencies.end());
+
+						double recall = 0, nCandidates = 0;
+						for (size_t i = 0; i < nq; i++) {
+							size_t want = std::min((size_t)limit, truth[i].size());
+							if (want == 0) {
+								continue;
+							}
+							// A neighbor as similar as the limit-th true one counts as found.
+							float kth = truth[i][want-1].similarity;
+							size_t matched = 0;
+							for (auto &n: found[i]) {
+								matched += n.similarity >= kth;
+							}
+							recall += (double)matched/(double)want;
+							nCandidates += (double)stats[i].candidates;
+						}
+
+						result r;
+						r.dataset = s.name;
+						r.hasher = hasherName;
+						r.n = points.size();
+						r.d = s.d;
+						r.k = k;
+						r.L = L;
+						r.limit = limit;
+						r.threads = nThreads;
+						r.probes = probes;
+						r.queries = nq;
+						r.buildSeconds = buildSeconds;
+						r.indexBytesPerPoint = (double)index->Bytes()/(double)points.size();
+						r.hasherBytes = (double)hasher->Bytes();
+						r.qps = (double)nq/wall;
+						r.p50 = quantile(latencies, 0.5);
+						r.p99 = quantile(latencies, 0.99);
+						r.p999 = quantile(latencies, 0.999);
+						r.recall = recall/(double)nq;
+						r.candidates = nCandidates/(double)nq;
+						r.print(json, *first);
+						*first = false;
+					}
+				}
+
+				delete index;
+				delete hasher;
+			}
+		}
+	}
+}
+
+// Runs every configuration of one dataset with vectors padded to dimension D.
+template <int D>
+static void run(const options &o, const dataset &s, size_t n, FILE *json, bool *first) {
+	typedef DenseVector<D> Vector;
+	std::vector<Vector> points = pad<D>(s.points, s.d, n);
+	std::vector<Vector> queries = pad<D>(s.queries, s.d, s.queries.size()/s.d);
+	size_t nq = queries.size();
+
+	// Brute force ground truth for the largest limit; smaller limits use a prefix.
+	int maxLimit = *std::max_element(o.limit.begin(), o.limit.end());
+	int maxThreads = slash::threadCount(*std::max_element(o.threads.begin(), o.threads.end()));
+	std::vector<std::vector<slash::Neighbor> > truth(nq);
+	std::vector<slash::PointID> ids(n);
+	std::vector<float> norms(n);
+	for (size_t j = 0; j < n; j++) {
+		ids[j] = (slash::PointID)j;
+		norms[j] = points[j].Norm();
+	}
+	double start = now();
+	slash::parallelFor(maxThreads, nq, [&](size_t begin, size_t end) {
+		slash::QueryContext c;
+		std::vector<float> similarities(n);
+		for (size_t i = begin; i < end; i++) {
+			c.Reset(maxLimit, n);
+			Vector::SimilarityBatch(queries[i], queries[i].Norm(), points.data(), norms.data(), ids.data(), n, similarities.data());
+			for (size_t j = 0; j < n; j++) {
+				c.Insert(ids[j], similarities[j], 1);
+			}
+			truth[i] = c.Neighbors();
+		}
+	});
+	fprintf(stderr, "ground truth for %llu queries over %llu points: %.2fs\n", (unsigned long long)nq, (unsigned long long)n, now() - start);
+
+	for (auto &h: o.hashers) {
+		if (h == "slsh") {
+			sweep<D, slash::SLSH<Vector> >(o, s, points, queries, truth, "slsh", json, first);
+		} else if (h == "qslsh") {
+			sweep<D, slash::QuantizedSLSH<Vector> >(o, s, points, queries, truth, "qslsh", json, first);
+		} else if (h == "simhash") {
+			sweep<D, slash::SimHash<Vector> >(o, s, points, queries, truth, "simhash", json, first);
+		} else {
+			sweep<D, slash::FastSLSH<Vector> >(o, s, points, queries, truth, "fastslsh", json, first);
+		}
+	}
+}
+
+// Dimensions vectors are padded to. Each one instantiates the whole sweep.
+static const int Dimensions[] = {16, 32, 64, 128, 256, 512, 1024};
+
+static void dispatch(const options &o, const dataset &s, size_t n, FILE *json, bool *first) {
+	switch (s.d <= 16 ? 16 : s.d <= 32 ? 32 : s.d <= 64 ? 64 : s.d <= 128 ? 128 : s.d <= 256 ? 256 : s.d <= 512 ? 512 : 1024) {
+	case 16: run<16>(o, s, n, json, first); break;
+	case 32: run<32>(o, s, n, json, first); break;
+	case 64: run<64>(o, s, n, json, first); break;
+	case 128: run<128>(o, s, n, json, first); break;
+	case 256: run<256>(o, s, n, json, first); break;
+	case 512: run<512>(o, s, n, json, first); break;
+	default: run<1024>(o, s, n, json, first); break;
+	}
+}
+
+int main(int argc, char **argv) {
+	options o = parseOptions(argc, argv);
+
+	FILE *json = nullptr;
+	if (o.out != nullptr) {
+		json = fopen(o.out, "w");
+		if (json == nullptr) {
+			perror(o.out);
+			return 1;
+		}
+		fprintf(json, "{\"compiler\": \"%s\", \"seed\": %u, \"results\": [", __VERSION__, o.seed);
+	}
+
+	bool first = true;
+	if (o.data != nullptr) {
+		dataset s;
+		if (!readFvecs(o.data, o.queries, &s)) {
+			return 1;
+		}
+		if (s.d > Dimensions[sizeof(Dimensions)/sizeof(Dimensions[0]) - 1]) {
+			fprintf(stderr, "%s: dimension %d is not supported\n", o.data, s.d);
+			return 1;
+		}
+		// -n takes prefixes of the file.
+		for (size_t n: o.n) {
+			dispatch(o, s, std::min(n, s.n), json, &first);
+		}
+	} else {
+		for (size_t n: o.n) {
+			for (int d: o.d) {
+				if (d <= 0 || d > Dimensions[sizeof(Dimensions)/sizeof(Dimensions[0]) - 1]) {
+					fprintf(stderr, "dimension %d is not supported\n", d);
+					return 1;
+				}
+				dataset s = synthetic(n, d, o.queries, o.seed, o.clusterSize, o.noise);
+				dispatch(o, s, n, json, &first);
+			}
+		}
+	}
+
+	if (json != nullptr) {
+		fprintf(json, "\n]}\n");
+		fclose(json);
+	}
+	return 0;
+}
@@ -0,0 +1,239 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_BITSAMPLING_H
+#define SLASH_BITSAMPLING_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "math.h"
+#include "multiprobe.h"
+#include "popcount.h"
+#include "types.h"
+#include "mappedfile.h"
+
+namespace slash {
+
+// Class BitSampling is a Hasher for binary codes under Hamming distance:
+// an elementary hash is one bit of the point, at a random position, so two
+// codes at Hamming distance r collide on it with probability 1 - r/d.
+// ``Indyk, P., Motwani, R., 1998. Approximate Nearest Neighbors: Towards
+// Removing the Curse of Dimensionality. STOC''.
+//
+// The k positions of a table are distinct and kept as a mask per word of
+// the code, so a hash is one bit extraction (PEXT) per word. Hashing costs
+// O(L) words instead of the O(kLd^2) floats of SLSH, at the price of a much
+// weaker hash: k has to be several times larger for the same selectivity.
+//
+// FeatureVector must provide the Words 64-bit words of its bits through
+// Word(w), like BitVector64 and BitVector.
+template <class FeatureVector>
+class BitSampling {
+	static const int Words = FeatureVector::Words;
+
+	// The bits sampled by table i are masks[i*Words + w] of word w. The masks
+	// are either maskStore or a view into a mapped index file.
+	std::vector<uint64_t> maskStore;
+	const uint64_t *masks;
+	int d;       // the dimension of the feature space.
+	int k;       // number of bits in a hash.
+	int l;       // number of tables.
+
+	BitSampling(const BitSampling&) = delete;
+	BitSampling &operator=(const BitSampling&) = delete;
+
+	// Layout of the head of a BitSampling written by Write.
+	struct header {
+		char magic[4];
+		uint32_t d;
+		uint32_t k;
+		uint32_t l;
+		uint32_t words;
+		uint32_t pad;
+	};
+
+	BitSampling() : masks(nullptr) {
+	}
+
+	// Returns the hash of p in table i.
+	inline HashType hash(const FeatureVector &p, int i) const {
+		const uint64_t *m = this->masks + (size_t)i*Words;
+		HashType h = 0;
+		unsigned int shift = 0;
+		for (int w=0; w<Words; w++) {
+			if (m[w] == 0) {
+				continue;
+			}
+			h |= (HashType)extractBits(p.Word(w), m[w]) << shift;
+			shift += (unsigned int)__builtin_popcountll(m[w]);
+		}
+		return h;
+	}
+
+public:
+	// Draws the positions with a seed from rand.
+	BitSampling(int d, int k, int L) : BitSampling(d, k, L, randomSeed()) {
+	}
+
+	// The positions of table i are drawn from stream i of seed, so the
+	// hasher depends on d, k, L and seed only.
+	BitSampling(int d, int k, int L, uint64_t seed) : d(d), k(k), l(L) {
+		assert(d <= 64*Words);
+		int kmax = MaxK(d);
+		if (k > kmax) {
+			this->k = kmax;
+			printf("k is too big, chopping down (%d->%d)\n", k, kmax);
+		}
+
+		this->maskStore.assign((size_t)this->l*Words, 0);
+		std::vector<int> positions(d);
+		for (int i=0; i<this->l; i++) {
+			counterRng r(seed, i);
+			for (int j=0; j<d; j++) {
+				positions[j] = j;
+			}
+			// A partial Fisher-Yates shuffle picks k distinct positions.
+			for (int j=0; j<this->k; j++) {
+				int t = j + (int)(r.Next() % (uint64_t)(d - j));
+				std::swap(positions[j], positions[t]);
+				this->maskStore[(size_t)i*Words + positions[j]/64] |= (uint64_t)1 << (positions[j]%64);
+			}
+		}
+		this->masks = this->maskStore.data();
+	}
+
+	// Returns the largest k for which a hash of a point of dimension d fits
+	// in a HashType: one bit per elementary hash, and at most d of them.
+	static int MaxK(int d) {
+		return std::min(d, (int)HashBits);
+	}
+
+	inline int D() const {
+		return this->d;
+	}
+
+	// Returns k, after chopping it down to MaxK.
+	inline int K() const {
+		return this->k;
+	}
+
+	inline int L() const {
+		return this->l;
+	}
+
+	// Hashes a single point l times, storing the result in g.
+	void Hash(const FeatureVector &p, HashType *g) const {
+		for (int i=0; i<this->l; i++) {
+			g[i] = this->hash(p, i);
+		}
+	}
+
+	// Returns the hash of p in table i alone, g[i] of Hash(p, g).
+	HashType HashTable(const FeatureVector &p, int i) const {
+		return this->hash(p, i);
+	}
+
+	// Hashes n points, storing l consecutive hashes per point in g (n*l in total).
+	void HashBatch(const FeatureVector *points, size_t n, HashType *g) const {
+		for (size_t j=0; j<n; j++) {
+			this->Hash(points[j], g + j*this->l);
+		}
+	}
+
+	// Hashes p like Hash, and additionally computes probes-1 alternative
+	// hashes for each table, laid out like in SLSH::HashProbes. An
+	// alternative flips some of the sampled bits; every bit is as likely to
+	// differ in a near neighbor, so single flips come first, then pairs.
+	void HashProbes(const FeatureVector &p, int probes, HashType *g) const {
+		std::vector<perturbation> ps;
+		for (int i=0; i<this->l; i++) {
+			HashType *gi = g + (size_t)i*probes;
+			gi[0] = this->hash(p, i);
+			ps.clear();
+			for (int j=0; j<this->k; j++) {
+				perturbation q = {1, j, (int)((~gi[0] >> j) & 1)};
+				ps.push_back(q);
+			}
+			enumerateProbes(ps, probes - 1, 1, gi[0], gi + 1);
+		}
+	}
+
+	// Memory used by the masks in bytes.
+	size_t Bytes() const {
+		return (size_t)this->l*Words*sizeof(uint64_t);
+	}
+
+	// Appends the parameters and the masks to an index file.
+	// Returns false on error.
+	bool Write(FILE *f) const {
+		header h = {{'B', 'S', 'M', 'P'}, (uint32_t)this->d, (uint32_t)this->k, (uint32_t)this->l, (uint32_t)Words, 0};
+		return writeAligned(f, &h, sizeof(h)) && writeAligned(f, this->masks, this->Bytes());
+	}
+
+	// Returns a BitSampling that hashes with the masks written by Write at
+	// data, which has size bytes available, without copying them. data must
+	// be cache line aligned and outlive the BitSampling. Returns nullptr if
+	// data is malformed, including masks that do not sample k positions
+	// below d in every table.
+	static BitSampling *Map(const char *data, size_t size) {
+		if (size < sizeof(header)) {
+			return nullptr;
+		}
+		header h;
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, "BSMP", 4) != 0 || h.d == 0 || h.d > 64*(uint32_t)Words || h.words != (uint32_t)Words ||
+			h.k > (uint32_t)MaxK(h.d) || h.l > INT32_MAX) {
+			return nullptr;
+		}
+		size_t at = alignedSize(sizeof(header));
+		if (!nextBlock(&at, (uint64_t)h.l*Words, sizeof(uint64_t), size)) {
+			return nullptr;
+		}
+
+		// Every table samples exactly k positions below d, or its hashes would
+		// not fit in k bits, nor match those of the points stored with them.
+		const uint64_t *masks = (const uint64_t*)(data + alignedSize(sizeof(header)));
+		for (size_t i=0; i<h.l; i++) {
+			uint32_t bits = 0;
+			for (int w=0; w<Words; w++) {
+				uint64_t m = masks[i*Words + w];
+				int64_t below = (int64_t)h.d - 64*w;  // positions of word w below d.
+				if (below < 64 && (below <= 0 ? m : m >> below) != 0) {
+					return nullptr;
+				}
+				bits += (uint32_t)__builtin_popcountll(m);
+			}
+			if (bits != h.k) {
+				return nullptr;
+			}
+		}
+
+		BitSampling *bs = new BitSampling();
+		bs->d = h.d;
+		bs->k = h.k;
+		bs->l = h.l;
+		bs->masks = masks;
+		return bs;
+	}
+};
+
+};
+
+#endif  // SLASH_BITSAMPLING_H
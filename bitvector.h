@@ -0,0 +1,169 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef BITVECTOR_H
+#define BITVECTOR_H
+
+#include <math.h>
+#include <string.h>
+#include "hash.h"
+#include "types.h"
+#include "popcount.h"
+
+namespace slash {
+
+// Calls f(I), f(I+1), ..., f(End-1), unrolled at compile time.
+template <int I, int End>
+struct unroll {
+	template <class F>
+	static inline void run(F &f) {
+		f(I);
+		unroll<I+1, End>::run(f);
+	}
+};
+
+template <int End>
+struct unroll<End, End> {
+	template <class F>
+	static inline void run(F &) {
+	}
+};
+
+};
+
+// Class BitVector is a binary feature vector of N bits, N a multiple of 64.
+// It is the same as BitVector64 for wider codes: all loops over words have
+// a compile-time trip count and are unrolled.
+template <int N>
+class BitVector {
+	static_assert(N > 0 && N % 64 == 0, "N must be a positive multiple of 64");
+
+public:
+	static const int Words = N/64;
+
+private:
+	uint64_t v[Words];
+
+	// Adds the elements of u at the set bits of word w of v to sum, byte by
+	// byte (see slash::dotBytes).
+	struct dotWord {
+		const uint64_t *v;
+		const float *u;
+		float sum;
+
+		inline void operator()(int w) {
+			this->sum = slash::dotBytes(this->v[w], this->u + 64*w, this->sum);
+		}
+	};
+
+	struct popcountWord {
+		const uint64_t *v;
+		int count;
+
+		inline void operator()(int w) {
+			this->count += __builtin_popcountll(this->v[w]);
+		}
+	};
+
+public:
+	BitVector() {
+		memset(this->v, 0, sizeof(this->v));
+	}
+
+	// Makes a vector from Words words, bit i being bit i%64 of words[i/64].
+	explicit BitVector(const uint64_t *words) {
+		memcpy(this->v, words, sizeof(this->v));
+	}
+
+	inline void Set(int i) {
+		this->v[i/64] |= (uint64_t)1 << (i%64);
+	}
+
+	inline bool Get(int i) const {
+		return (this->v[i/64] >> (i%64)) & 1;
+	}
+
+	inline uint64_t Word(int w) const {
+		return this->v[w];
+	}
+
+	inline char* String(char *buffer) const { // For debugging. Don't use.
+		if (buffer == 0) {
+			buffer = new char[N+1];
+		}
+		for (int i=0; i<N; i++) {
+			buffer[i] = this->Get(N-1-i) ? '1' : '0';
+		}
+		buffer[N] = 0;
+		return buffer;
+	}
+
+
+	// Needed by lsh. Impacts performance greatly.
+	inline float Dot(const float *u) const {
+		dotWord f = {this->v, u, 0};
+		slash::unroll<0, Words>::run(f);
+		return f.sum;
+	}
+
+	// Needed by FastSLSH. Stores the N coordinates of the vector, 0 or 1, in x.
+	inline void Unpack(float *x) const {
+		for (int i=0; i<N; i++) {
+			x[i] = (float)((this->v[i/64] >> (i%64)) & 1);
+		}
+	}
+
+	// Euclidean norm of the vector.
+	inline float Norm() const {
+		popcountWord f = {this->v, 0};
+		slash::unroll<0, Words>::run(f);
+		return sqrtf((float)f.count);
+	}
+
+	inline float Similarity(const BitVector &q) const {
+		float dot = (float)slash::andPopcount<Words>(this->v, q.v);
+		return dot/(this->Norm()*q.Norm());
+	}
+
+	// Needed by lsh. Stores in out[j] the similarity of q to points[ids[j]]
+	// for j < n, given qNorm = q.Norm() and norms[id] = points[id].Norm().
+	// Gives the result of Similarity up to rounding, within a relative 1e-6,
+	// like BitVector64::SimilarityBatch.
+	static void SimilarityBatch(const BitVector &q, float qNorm, const BitVector *points, const float *norms, const slash::PointID *ids, size_t n, float *out) {
+		for (size_t j = 0; j < n; j++) {
+			float dot = (float)slash::andPopcount<Words>(q.v, points[ids[j]].v);
+			out[j] = dot/(qNorm*norms[ids[j]]);
+		}
+	}
+	
+	inline int NCopies() const {
+		return 1;
+	}
+
+
+	// operators needed by sparsehash.
+	inline bool operator==(const BitVector &q) const {
+		return memcmp(this->v, q.v, sizeof(this->v)) == 0;
+	}
+	inline size_t operator()(const BitVector &p) const {
+		return hash(p.v, sizeof(p.v), 1);
+	}
+	inline bool operator()(const BitVector &p, const BitVector &q) const {
+		return p == q;
+	}
+};
+
+#endif  // BITVECTOR_H
@@ -17,13 +17,19 @@
 #ifndef BITVECTOR64_H
 #define BITVECTOR64_H
 
+#include <math.h>
 #include "hash.h"
 #include "util.h"
+#include "types.h"
+#include "popcount.h"
 
 class BitVector64 {
 	uint64_t v;
 
 public:
+	// Needed by TableSLSH, with Word.
+	static const int Words = 1;
+
 	BitVector64() {
 		this->v = 0;
 	}
@@ -32,6 +38,10 @@ public:
 		this->v = v;
 	}
 	
+	inline uint64_t Word(int) const {
+		return this->v;
+	}
+
 	inline char* String(char *buffer) const { // For debugging. Don't use.
 		if (buffer == 0) {
 			buffer = new char[64+1];
@@ -42,21 +52,50 @@ public:
 
 
 	// Needed by lsh. Impacts performance greatly.
-	inline float Dot(float *u) const {
-		float sum = 0;
-		uint64_t v = this->v;
-		for(int i=0; v && i<64; i++, v>>=1) {
-			if (v&1) {
-				sum += u[i];
-			}
-		}
-		return sum;
+	// Sums byte by byte, see slash::dotBytes.
+	inline float Dot(const float *u) const {
+		return slash::dotBytes(this->v, u, 0);
 	}
 	
+	// Needed by FastSLSH. Stores the 64 coordinates of the vector, 0 or 1, in x.
+	inline void Unpack(float *x) const {
+		for (int i=0; i<64; i++) {
+			x[i] = (float)((this->v >> i) & 1);
+		}
+	}
+
+	// Euclidean norm of the vector.
+	inline float Norm() const {
+		return sqrtf((float)__builtin_popcountll(this->v));
+	}
+
 	inline float Similarity(const BitVector64 &q) const {
 		float dot = (float)__builtin_popcountll(this->v & q.v);
-		float norm = (float)(__builtin_popcountll(this->v)*__builtin_popcountll(q.v)); 
-		return dot/sqrtf(norm);
+		return dot/(this->Norm()*q.Norm());
+	}
+
+	// Needed by lsh. Stores in out[j] the similarity of q to points[ids[j]]
+	// for j < n, given qNorm = q.Norm() and norms[id] = points[id].Norm().
+	// Gives the result of Similarity up to rounding: the dot products are
+	// exact, but -ffast-math lets the compiler round the norms and the
+	// division differently here, within a relative 1e-6.
+	// The candidates are gathered into a packed block of words that is
+	// scored with a SIMD popcount.
+	static void SimilarityBatch(const BitVector64 &q, float qNorm, const BitVector64 *points, const float *norms, const slash::PointID *ids, size_t n, float *out) {
+		const size_t Block = 64;
+		uint64_t words[Block];
+		uint32_t dots[Block];
+
+		for (size_t j0 = 0; j0 < n; j0 += Block) {
+			size_t bn = n - j0 < Block ? n - j0 : Block;
+			for (size_t j = 0; j < bn; j++) {
+				words[j] = points[ids[j0+j]].v;
+			}
+			slash::andPopcounts(q.v, words, bn, dots);
+			for (size_t j = 0; j < bn; j++) {
+				out[j0+j] = (float)dots[j]/(qNorm*norms[ids[j0+j]]);
+			}
+		}
 	}
 	
 	inline int NCopies() const {
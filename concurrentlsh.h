@@ -0,0 +1,364 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_CONCURRENTLSH_H
+#define SLASH_CONCURRENTLSH_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "types.h"
+#include "lsh.h"
+
+namespace slash {
+
+// Class ConcurrentLSH is an index that answers queries from any number of
+// threads while points are being inserted.
+//
+// The points live in segments, each a frozen LSH over a contiguous range of
+// ids, all hashing with the same hasher. A version is the list of segments
+// visible to queries. Insert collects points in a pending batch; Publish
+// freezes the batch into a new segment and atomically replaces the current
+// version with one that includes it. Queries never lock: they run against
+// the version that was current when they started, and never see a partly
+// built segment.
+//
+// Like in a log-structured merge tree, a new segment at least as large as
+// the one before it is merged with it, so there are O(log n) segments and a
+// point is rehashed O(log n) times over the life of the index.
+//
+// A replaced version is freed once no query can still be reading it. Every
+// query announces the epoch it started in through one of MaxReaders slots;
+// a version retired at epoch e is freed when all busy slots hold an epoch of
+// at least e. Freeing is done by the writer, at the end of Publish.
+//
+// Inserts and Publish are serialized by a mutex and may be called from any
+// thread. Queries by id only see published points.
+template <class FeatureVector, class Hasher>
+class ConcurrentLSH {
+	typedef LSH<FeatureVector, Hasher> index;
+
+	// Number of queries that can be running at once; more wait for a slot.
+	static const int MaxReaders = 64;
+
+	// Number of hashes Query keeps on the stack.
+	static const int MaxStackHashes = 256;
+
+	struct segment {
+		std::shared_ptr<index> lsh;
+		PointID base;  // id of the first point of the segment.
+	};
+
+	// An immutable list of segments, by increasing base.
+	struct version {
+		std::vector<segment> segments;
+		size_t nPoints;
+	};
+
+	// An epoch slot on a cache line of its own. 0 means free.
+	struct alignas(CacheLine) slot {
+		std::atomic<uint64_t> epoch;
+	};
+
+	int d, k, l, threads, probes;
+	size_t batchSize;
+	Hasher *hasher;
+
+	std::atomic<version*> current;
+	std::atomic<uint64_t> epoch;
+	mutable slot slots[MaxReaders];
+
+	// Writer state, guarded by mutex.
+	std::mutex mutex;
+	std::vector<FeatureVector> pending;
+	std::vector<std::pair<version*, uint64_t>> retired;  // versions and the epochs they were retired at.
+	size_t nRetired;
+	size_t nFreed;
+
+	ConcurrentLSH(const ConcurrentLSH&) = delete;
+	ConcurrentLSH &operator=(const ConcurrentLSH&) = delete;
+
+	// Marks the calling thread as reading for the life of the guard, and
+	// gives the version it may read.
+	class readGuard {
+		std::atomic<uint64_t> *s;
+	public:
+		const version *v;
+
+		explicit readGuard(const ConcurrentLSH *c) {
+			static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+			uint64_t e = c->epoch.load();
+			for (size_t i = hint;; i++) {
+				uint64_t free = 0;
+				std::atomic<uint64_t> *t = &c->slots[i % MaxReaders].epoch;
+				if (t->load(std::memory_order_relaxed) == 0 && t->compare_exchange_strong(free, e)) {
+					this->s = t;
+					hint = i;
+					break;
+				}
+				if (i % MaxReaders == MaxReaders-1) {
+					std::this_thread::yield();
+				}
+			}
+			// Loaded after the slot is taken: a version retired after this
+			// point is kept until the slot is freed.
+			this->v = c->current.load();
+		}
+
+		~readGuard() {
+			this->s->store(0);
+		}
+	};
+
+	// Hashes p for queries into g, which has room for l*probes hashes.
+	void hash(const FeatureVector &p, HashType *g) const {
+		if (this->probes > 1) {
+			this->hasher->HashProbes(p, this->probes, g);
+		} else {
+			this->hasher->Hash(p, g);
+		}
+	}
+
+	// Returns the index of the segment of v holding id.
+	static size_t find(const version *v, PointID id) {
+		auto it = std::upper_bound(v->segments.begin(), v->segments.end(), id, [](PointID id, const segment &s) {
+			return id < s.base;
+		});
+		return (size_t)(it - v->segments.begin()) - 1;
+	}
+
+	// Returns the neighbors of p in all segments of v, with global ids, at
+	// most limit of them, most similar first. If self is not MaxPointID, it
+	// is the id of p, whose hashes are taken from its segment there.
+	std::vector<Neighbor> query(const version *v, const FeatureVector &p, PointID self, int limit, QueryStats *stats) const {
+		size_t n = (size_t)this->l*this->probes;
+		HashType stackBuffer[MaxStackHashes];
+		std::vector<HashType> heapBuffer;
+		HashType *g = stackBuffer;
+		if (n > MaxStackHashes) {
+			heapBuffer.resize(n);
+			g = heapBuffer.data();
+		}
+		bool hashed = false;
+
+		std::vector<Neighbor> neighbors;
+		for (const segment &s: v->segments) {
+			std::vector<Neighbor> found;
+			if (self != MaxPointID && self >= s.base && self - s.base < s.lsh->Size()) {
+				found = s.lsh->Query(self - s.base, limit, stats);
+			} else {
+				if (!hashed) {
+					this->hash(p, g);
+					hashed = true;
+				}
+				found = s.lsh->Query(p, g, limit, stats);
+			}
+			for (Neighbor &m: found) {
+				m.id += s.base;
+				neighbors.push_back(m);
+			}
+		}
+
+		auto bySimilarity = [](const Neighbor &a, const Neighbor &b) {
+			return a.similarity > b.similarity || (a.similarity == b.similarity && a.id < b.id);
+		};
+		if (neighbors.size() > (size_t)limit) {
+			std::partial_sort(neighbors.begin(), neighbors.begin() + limit, neighbors.end(), bySimilarity);
+			neighbors.resize(limit);
+		} else {
+			std::sort(neighbors.begin(), neighbors.end(), bySimilarity);
+		}
+		return neighbors;
+	}
+
+	// Returns a frozen segment holding the given runs of points, in order.
+	std::shared_ptr<index> build(const std::vector<std::pair<const FeatureVector*, size_t>> &runs) const {
+		std::shared_ptr<index> lsh(new index(this->d, this->k, this->l, this->hasher));
+		lsh->SetThreads(this->threads);
+		lsh->SetProbes(this->probes);
+		for (auto &run: runs) {
+			lsh->Insert(run.first, run.second);
+		}
+		lsh->Freeze();
+		return lsh;
+	}
+
+	// Turns the pending points into a new version. Must hold mutex.
+	void publish() {
+		if (!this->pending.empty()) {
+			version *old = this->current.load();
+			version *v = new version(*old);
+
+			segment s = {this->build({{this->pending.data(), this->pending.size()}}), (PointID)old->nPoints};
+			v->segments.push_back(s);
+			v->nPoints = old->nPoints + this->pending.size();
+			this->pending.clear();
+
+			// Segments hold the points in id order, so two neighboring
+			// segments merge into one covering both of their ranges.
+			while (v->segments.size() >= 2) {
+				segment &a = v->segments[v->segments.size()-2], &b = v->segments.back();
+				if (b.lsh->Size() < a.lsh->Size()) {
+					break;
+				}
+				a.lsh = this->build({{&a.lsh->Point(0), a.lsh->Size()}, {&b.lsh->Point(0), b.lsh->Size()}});
+				v->segments.pop_back();
+			}
+
+			this->current.store(v);
+			this->retired.push_back(std::make_pair(old, this->epoch.fetch_add(1) + 1));
+			this->nRetired++;
+		}
+		this->reclaim();
+	}
+
+	// Frees the retired versions no query can be reading. Must hold mutex.
+	void reclaim() {
+		uint64_t min = UINT64_MAX;
+		for (int i = 0; i < MaxReaders; i++) {
+			uint64_t e = this->slots[i].epoch.load();
+			if (e != 0 && e < min) {
+				min = e;
+			}
+		}
+		size_t kept = 0;
+		for (auto &r: this->retired) {
+			if (r.second <= min) {
+				delete r.first;
+				this->nFreed++;
+			} else {
+				this->retired[kept++] = r;
+			}
+		}
+		this->retired.resize(kept);
+	}
+
+public:
+	// d, k and L are as in LSH; every segment hashes with hasher, which must
+	// outlive the index. probes is the number of buckets queries visit in
+	// each table, see LSH::SetProbes.
+	ConcurrentLSH(int d, int k, int L, Hasher *hasher, int probes = 1) : d(d), k(k), l(L), threads(1),
+		probes(probes > 1 ? probes : 1), batchSize(0), hasher(hasher), epoch(1), nRetired(0), nFreed(0) {
+		version *v = new version();
+		v->nPoints = 0;
+		this->current.store(v);
+		for (int i = 0; i < MaxReaders; i++) {
+			this->slots[i].epoch.store(0);
+		}
+	}
+
+	// Must not be called while queries are running.
+	~ConcurrentLSH() {
+		delete this->current.load();
+		for (auto &r: this->retired) {
+			delete r.first;
+		}
+	}
+
+	// Sets the number of threads used to build segments, see LSH::SetThreads.
+	void SetThreads(int n) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->threads = threadCount(n);
+	}
+
+	// Makes Insert publish the pending points once there are at least n of
+	// them. 0, the default, leaves publishing to Publish.
+	void SetBatchSize(size_t n) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->batchSize = n;
+	}
+
+	// Adds points to the pending batch; the i-th of them gets the id
+	// returned + i. They become visible to queries when the batch is published.
+	PointID Insert(const FeatureVector *points, size_t nPoints) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		size_t first = this->current.load()->nPoints + this->pending.size();
+		assert(first + nPoints <= (size_t)MaxPointID);
+		this->pending.insert(this->pending.end(), points, points + nPoints);
+		if (this->batchSize > 0 && this->pending.size() >= this->batchSize) {
+			this->publish();
+		}
+		return (PointID)first;
+	}
+
+	PointID Insert(const std::vector<FeatureVector> &points) {
+		return this->Insert(points.data(), points.size());
+	}
+
+	// Makes all inserted points visible to queries that start after it
+	// returns, and frees the versions that are no longer read.
+	void Publish() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->publish();
+	}
+
+	// Returns nearest neighbors of the published point id, excluding itself;
+	// at most limit entries, most similar first.
+	// If stats is not nullptr, the work done is added to it.
+	std::vector<Neighbor> Query(PointID id, int limit, QueryStats *stats = nullptr) const {
+		readGuard r(this);
+		assert(id < r.v->nPoints);
+		const segment &s = r.v->segments[find(r.v, id)];
+		return this->query(r.v, s.lsh->Point(id - s.base), id, limit, stats);
+	}
+
+	// Returns nearest neighbors of p among the published points; at most
+	// limit entries, most similar first. p is hashed once for all segments.
+	std::vector<Neighbor> Query(const FeatureVector &p, int limit, QueryStats *stats = nullptr) const {
+		readGuard r(this);
+		return this->query(r.v, p, MaxPointID, limit, stats);
+	}
+
+	// Returns a copy of the published point with the given id. A reference
+	// could outlive the segment holding it.
+	FeatureVector Point(PointID id) const {
+		readGuard r(this);
+		assert(id < r.v->nPoints);
+		const segment &s = r.v->segments[find(r.v, id)];
+		return s.lsh->Point(id - s.base);
+	}
+
+	// Returns the number of published points.
+	size_t Size() const {
+		readGuard r(this);
+		return r.v->nPoints;
+	}
+
+	// Returns the number of segments of the current version.
+	size_t Segments() const {
+		readGuard r(this);
+		return r.v->segments.size();
+	}
+
+	// Returns the number of versions replaced so far, and stores in freed
+	// how many of them were freed.
+	size_t Versions(size_t *freed) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		*freed = this->nFreed;
+		return this->nRetired;
+	}
+};
+
+};
+
+#endif  // SLASH_CONCURRENTLSH_H
@@ -0,0 +1,118 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DENSEVECTOR_H
+#define DENSEVECTOR_H
+
+#include <math.h>
+#include <string.h>
+#include "hash.h"
+#include "types.h"
+#include "dot.h"
+
+// Class DenseVector is a D-dimensional real feature vector, such as an
+// embedding, compared by cosine similarity.
+//
+// The coordinates are padded with zeros up to a whole number of cache lines
+// (Padded floats), so the dot product kernels run without a scalar tail.
+// The norm is computed once on construction.
+template <int D>
+class DenseVector {
+	static_assert(D > 0, "D must be positive");
+
+public:
+	static const int Padded = (D + 15) / 16 * 16;
+
+private:
+	float v[Padded];
+	float norm;
+
+public:
+	DenseVector() : norm(0) {
+		memset(this->v, 0, sizeof(this->v));
+	}
+
+	// Makes a vector from D coordinates.
+	explicit DenseVector(const float *x) {
+		memcpy(this->v, x, D*sizeof(float));
+		memset(this->v + D, 0, (Padded - D)*sizeof(float));
+		this->norm = sqrtf(slash::dot<Padded>(this->v, this->v));
+	}
+
+	inline const float *Data() const {
+		return this->v;
+	}
+
+
+	// Needed by lsh. Impacts performance greatly.
+	// Reads Padded floats of u; the ones past D are multiplied by zero.
+	// The rows of the SLSH rotation panel are padded like this.
+	inline float Dot(const float *u) const {
+		return slash::dot<Padded>(this->v, u);
+	}
+
+	// Needed by FastSLSH. Stores the D coordinates of the vector in x.
+	inline void Unpack(float *x) const {
+		memcpy(x, this->v, D*sizeof(float));
+	}
+
+	// Euclidean norm of the vector.
+	inline float Norm() const {
+		return this->norm;
+	}
+
+	// Cosine similarity.
+	inline float Similarity(const DenseVector &q) const {
+		return slash::dot<Padded>(this->v, q.v)/(this->norm*q.norm);
+	}
+
+	// Needed by lsh. Stores in out[j] the similarity of q to points[ids[j]]
+	// for j < n, given qNorm = q.Norm() and norms[id] = points[id].Norm().
+	// Gives the result of Similarity up to rounding, within a relative 1e-6:
+	// both use slash::dot, but -ffast-math lets the compiler contract and
+	// reassociate it differently once inlined. The next candidates are
+	// prefetched while the current one is scored.
+	static void SimilarityBatch(const DenseVector &q, float qNorm, const DenseVector *points, const float *norms, const slash::PointID *ids, size_t n, float *out) {
+		const size_t Ahead = 4;
+		for (size_t j = 0; j < n; j++) {
+			if (j + Ahead < n) {
+				const char *next = (const char*)points[ids[j+Ahead]].v;
+				for (size_t b = 0; b < sizeof(points->v); b += slash::CacheLine) {
+					__builtin_prefetch(next + b);
+				}
+			}
+			out[j] = slash::dot<Padded>(q.v, points[ids[j]].v)/(qNorm*norms[ids[j]]);
+		}
+	}
+	
+	inline int NCopies() const {
+		return 1;
+	}
+
+
+	// operators needed by sparsehash.
+	inline bool operator==(const DenseVector &q) const {
+		return memcmp(this->v, q.v, sizeof(this->v)) == 0;
+	}
+	inline size_t operator()(const DenseVector &p) const {
+		return hash(p.v, sizeof(p.v), 1);
+	}
+	inline bool operator()(const DenseVector &p, const DenseVector &q) const {
+		return p == q;
+	}
+};
+
+#endif  // DENSEVECTOR_H
@@ -0,0 +1,117 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_DOT_H
+#define SLASH_DOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace slash {
+
+// Returns the dot product of a and b, which have N floats each, N a
+// multiple of 16. Neither needs to be aligned.
+//
+// Uses 16-wide FMA with AVX-512, 8-wide FMA with AVX2 and FMA, and a plain
+// loop otherwise. The vector paths keep two independent accumulators to
+// hide the FMA latency.
+template <int N>
+inline float dot(const float *a, const float *b) {
+	static_assert(N % 16 == 0, "N must be a multiple of 16");
+
+#if defined(__AVX512F__)
+	__m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+	int i = 0;
+	for (; i + 32 <= N; i += 32) {
+		s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+		s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+	}
+	if (i < N) {
+		s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+	}
+	float lanes[16];
+	_mm512_storeu_ps(lanes, _mm512_add_ps(s0, s1));
+	float s = 0;
+	for (int j = 0; j < 16; j++) {
+		s += lanes[j];
+	}
+	return s;
+#elif defined(__AVX2__) && defined(__FMA__)
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	for (int i = 0; i < N; i += 16) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+	}
+	__m256 h = _mm256_add_ps(s0, s1);
+	__m128 q = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+	q = _mm_add_ps(q, _mm_movehl_ps(q, q));
+	q = _mm_add_ss(q, _mm_movehdup_ps(q));
+	return _mm_cvtss_f32(q);
+#else
+	float s = 0;
+	for (int i = 0; i < N; i++) {
+		s += a[i]*b[i];
+	}
+	return s;
+#endif
+}
+
+// Returns the dot product of the n floats of a and the n bytes of b, n a
+// multiple of 16. Neither needs to be aligned. Reads a quarter of the
+// memory of a float dot product for b, which is what QuantizedSLSH is after.
+inline float dotInt8(const float *a, const int8_t *b, size_t n) {
+#if defined(__AVX512F__)
+	__m512 s0 = _mm512_setzero_ps();
+	for (size_t i = 0; i < n; i += 16) {
+		// The zero-masked forms convert the same; GCC warns on the plain ones.
+		__m512i w = _mm512_maskz_cvtepi8_epi32(0xffff, _mm_loadu_si128((const __m128i*)(b + i)));
+		__m512 q = _mm512_maskz_cvtepi32_ps(0xffff, w);
+		s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), q, s0);
+	}
+	float lanes[16];
+	_mm512_storeu_ps(lanes, s0);
+	float s = 0;
+	for (int j = 0; j < 16; j++) {
+		s += lanes[j];
+	}
+	return s;
+#elif defined(__AVX2__) && defined(__FMA__)
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i q = _mm_loadu_si128((const __m128i*)(b + i));
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q)), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q, 8))), s1);
+	}
+	__m256 h = _mm256_add_ps(s0, s1);
+	__m128 q = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+	q = _mm_add_ps(q, _mm_movehl_ps(q, q));
+	q = _mm_add_ss(q, _mm_movehdup_ps(q));
+	return _mm_cvtss_f32(q);
+#else
+	float s = 0;
+	for (size_t i = 0; i < n; i++) {
+		s += a[i]*(float)b[i];
+	}
+	return s;
+#endif
+}
+
+};
+
+#endif  // SLASH_DOT_H
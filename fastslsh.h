@@ -0,0 +1,305 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_FASTSLSH_H
+#define SLASH_FASTSLSH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "math.h"
+#include "multiprobe.h"
+#include "types.h"
+#include "mappedfile.h"
+
+namespace slash {
+
+// Class FastSLSH is a drop-in replacement for SLSH that uses pseudo-random
+// rotations instead of exact ones. A rotation is Rounds rounds of a random
+// sign flip of every coordinate followed by a Walsh-Hadamard transform, as in
+// ``Andoni, A., Indyk, P., Laarhoven, T., Razenshteyn, I., Schmidt, L., 2015.
+// Practical and Optimal LSH for Angular Distance. NIPS''.
+//
+// Points are padded with zeros up to n, the next power of two at least d,
+// and hashed to the closest of the 2n vertices of an n-dimensional orthoplex.
+// An elementary hash costs O(n log n) instead of the O(d^2) of SLSH, and a
+// rotation takes Rounds*n floats instead of d^2, so this is the choice for
+// large d. Hashes are not interchangeable with those of SLSH.
+//
+// FeatureVector must provide Unpack(float *x), storing its d coordinates in x.
+template <class FeatureVector>
+class FastSLSH {
+	static const int Rounds = 3;
+
+	// Number of floats of scratch space Hash and HashProbes keep on the stack.
+	static const int MaxStackFloats = 2048;
+
+	// The signs of all k*l rotations, +1 or -1. Round r of rotation m flips
+	// coordinate i if signs[(m*Rounds + r)*n + i] is -1.
+	// The signs are either ownedSigns or a view into a mapped index file.
+	const float *signs;
+	float *ownedSigns;
+	int n;       // dimension of the rotated space.
+	unsigned int hbits;     // Log2(2*n).
+	int d;       // the dimension of the feature space.
+	int k;       // number of elementary hash functions concatenated in a hash.
+	int l;       // number of tables.
+
+	FastSLSH(const FastSLSH&) = delete;
+	FastSLSH &operator=(const FastSLSH&) = delete;
+
+	// Layout of the head of a FastSLSH written by Write.
+	struct header {
+		char magic[4];
+		uint32_t d;
+		uint32_t k;
+		uint32_t l;
+		uint32_t hbits;
+		uint32_t n;
+	};
+
+	FastSLSH() : signs(nullptr), ownedSigns(nullptr) {
+	}
+
+	// Returns the smallest power of two at least d, and at least a cache line
+	// of floats so that the signs of every round stay aligned.
+	static int rotatedDimension(int d) {
+		int n = CacheLine/sizeof(float);
+		while (n < d) {
+			n *= 2;
+		}
+		return n;
+	}
+
+	// Rotates the n floats of y with rotation m. The result is scaled by
+	// n^(Rounds/2), which changes neither the argmax nor the order of gaps.
+	inline void rotate(float *y, int m) const {
+		const float *s = this->signs + (size_t)m*Rounds*this->n;
+		for (int r=0; r<Rounds; r++, s+=this->n) {
+			for (int i=0; i<this->n; i++) {
+				y[i] *= s[i];
+			}
+			walshHadamard(y, this->n);
+		}
+	}
+
+	// Returns the vertex closest to the rotated point y, and its score in max.
+	// Ties go to the last coordinate, like in SLSH.
+	inline int argmaxi(const float *y, float *max) const {
+		int maxi = 0;
+		float m = 0;
+		for (int i=0; i<this->n; i++) {
+			float dot = y[i];
+			float abs = dot>=0?dot:-dot;
+			bool take = !(abs < m);
+			m = take ? abs : m;
+			maxi = take ? (dot >= 0 ? i : i + this->n) : maxi;
+		}
+		*max = m;
+		return maxi;
+	}
+
+	// Returns the hash in table i of the point with coordinates x, padded
+	// with zeros to n floats, using the n floats of scratch space in y.
+	HashType hashTable(const float *x, float *y, int i) const {
+		HashType g = 0;
+		for (int j=0; j<this->k; j++) {
+			memcpy(y, x, this->n*sizeof(float));
+			this->rotate(y, i*this->k + j);
+			float max;
+			g |= (HashType)this->argmaxi(y, &max) << (HashType)(this->hbits*j);
+		}
+		return g;
+	}
+
+	// Hashes p into g using the 2n floats of scratch space, or only table i
+	// if i >= 0.
+	void hash(const FeatureVector &p, float *scratch, HashType *g, int i = -1) const {
+		float *x = scratch, *y = scratch + this->n;
+		memset(x, 0, this->n*sizeof(float));
+		p.Unpack(x);
+		if (i >= 0) {
+			*g = this->hashTable(x, y, i);
+			return;
+		}
+		for (i=0; i<this->l; i++) {
+			g[i] = this->hashTable(x, y, i);
+		}
+	}
+
+public:
+	// Draws the signs with a seed from rand.
+	FastSLSH(int d, int k, int L) : FastSLSH(d, k, L, randomSeed()) {
+	}
+
+	// The signs are drawn from seed, so the hasher depends on d, k, L and
+	// seed only.
+	FastSLSH(int d, int k, int L, uint64_t seed) : d(d), k(k), l(L) {
+		this->n = rotatedDimension(d);
+		this->hbits = (unsigned int)ceil(log2(2.0*this->n));
+		int kmax = MaxK(d);
+		if (this->k > kmax) {
+			this->k = kmax;
+			printf("k is too big, chopping down (%d->%d)\n", k, kmax);
+		}
+
+		counterRng r(seed, 0);
+		size_t nsigns = (size_t)this->k*this->l*Rounds*this->n;
+		this->ownedSigns = alignedFloats(nsigns);
+		this->signs = this->ownedSigns;
+		for (size_t i=0; i<nsigns; i++) {
+			this->ownedSigns[i] = (r.Next() >> 63) ? -1.0f : 1.0f;
+		}
+	}
+
+	// Returns the largest k for which the k elementary hashes of a point of
+	// dimension d fit in a HashType. Larger values are chopped down to it.
+	static int MaxK(int d) {
+		return static_cast<int>(HashBits/(unsigned int)ceil(log2(2.0*rotatedDimension(d))));
+	}
+
+	inline int D() const {
+		return this->d;
+	}
+
+	// Returns k, after chopping it down to MaxK.
+	inline int K() const {
+		return this->k;
+	}
+
+	inline int L() const {
+		return this->l;
+	}
+
+	// Hashes a single point l times, storing the result in g.
+	//
+	// Like SLSH, requires all vectors to have the same norm.
+	//
+	// The complexity of this function is O(kL n log n).
+	void Hash(const FeatureVector &p, HashType *g) const {
+		float stack[MaxStackFloats];
+		std::vector<float> heap;
+		float *scratch = stack;
+		if (2*this->n > MaxStackFloats) {
+			heap.resize(2*this->n);
+			scratch = heap.data();
+		}
+		this->hash(p, scratch, g);
+	}
+
+	// Returns the hash of p in table i alone, g[i] of Hash(p, g).
+	HashType HashTable(const FeatureVector &p, int i) const {
+		float stack[MaxStackFloats];
+		std::vector<float> heap;
+		float *scratch = stack;
+		if (2*this->n > MaxStackFloats) {
+			heap.resize(2*this->n);
+			scratch = heap.data();
+		}
+		HashType g;
+		this->hash(p, scratch, &g, i);
+		return g;
+	}
+
+	// Hashes n points, storing l consecutive hashes per point in g (n*l in total).
+	// Gives the same result as calling Hash on each point.
+	void HashBatch(const FeatureVector *points, size_t n, HashType *g) const {
+		std::vector<float> scratch(2*this->n);
+		for (size_t j=0; j<n; j++) {
+			this->hash(points[j], scratch.data(), g + j*this->l);
+		}
+	}
+
+	// Hashes p like Hash, and additionally computes probes-1 alternative
+	// hashes for each table, laid out like in SLSH::HashProbes: g[i*probes]
+	// is the hash of table i and g[i*probes + t] its t-th alternative.
+	// Vertex r (r+n) scores coordinate r of the rotated point (its negation).
+	void HashProbes(const FeatureVector &p, int probes, HashType *g) const {
+		std::vector<float> x(this->n), y(this->n);
+		std::vector<perturbation> ps;
+		int keep = probes - 1;  // no more runner-ups of a single elementary hash can be used.
+		p.Unpack(x.data());
+
+		int m = 0;
+		for (int i=0; i<this->l; i++) {
+			HashType *gi = g + (size_t)i*probes;
+			gi[0] = 0;
+			ps.clear();
+
+			for (int j=0; j<this->k; j++, m++) {
+				std::copy(x.begin(), x.end(), y.begin());
+				this->rotate(y.data(), m);
+				float max;
+				int maxi = this->argmaxi(y.data(), &max);
+				gi[0] |= (HashType)maxi << (HashType)(this->hbits*j);
+				addPerturbations(y.data(), this->n, j, maxi, max, keep, ps);
+			}
+
+			std::sort(ps.begin(), ps.end());
+			enumerateProbes(ps, keep, this->hbits, gi[0], gi + 1);
+		}
+	}
+
+	// Memory used by the rotations in bytes.
+	size_t Bytes() const {
+		return (size_t)this->k*this->l*Rounds*this->n*sizeof(float);
+	}
+
+	// Appends the parameters and the signs to an index file.
+	// Returns false on error.
+	bool Write(FILE *f) const {
+		header h = {{'F', 'S', 'L', 'H'}, (uint32_t)this->d, (uint32_t)this->k, (uint32_t)this->l, this->hbits, (uint32_t)this->n};
+		return writeAligned(f, &h, sizeof(h)) && writeAligned(f, this->signs, this->Bytes());
+	}
+
+	// Returns a FastSLSH that hashes with the signs written by Write at data,
+	// which has size bytes available, without copying them. data must be
+	// cache line aligned and outlive the FastSLSH. Returns nullptr if data is malformed.
+	static FastSLSH *Map(const char *data, size_t size) {
+		if (size < sizeof(header)) {
+			return nullptr;
+		}
+		header h;
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, "FSLH", 4) != 0 || h.d == 0 || h.d > INT32_MAX || h.l > INT32_MAX ||
+			h.n != (uint32_t)rotatedDimension(h.d) || h.hbits != (uint32_t)ceil(log2(2.0*h.n)) ||
+			(uint64_t)h.k*h.hbits > HashBits) {
+			return nullptr;
+		}
+		size_t at = alignedSize(sizeof(header)), nsigns;
+		if (__builtin_mul_overflow((size_t)h.k*h.l, (size_t)Rounds*h.n, &nsigns) || !nextBlock(&at, nsigns, sizeof(float), size)) {
+			return nullptr;
+		}
+
+		FastSLSH *fslsh = new FastSLSH();
+		fslsh->d = h.d;
+		fslsh->k = h.k;
+		fslsh->l = h.l;
+		fslsh->hbits = h.hbits;
+		fslsh->n = h.n;
+		fslsh->signs = (const float*)(data + alignedSize(sizeof(header)));
+		return fslsh;
+	}
+
+	~FastSLSH() {
+		freeAligned(this->ownedSigns);
+	}
+};
+
+};
+
+#endif  // SLASH_FASTSLSH_H
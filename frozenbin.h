@@ -0,0 +1,367 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_FROZENBIN_H
+#define SLASH_FROZENBIN_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "types.h"
+#include "mappedfile.h"
+
+namespace slash {
+
+// Sorts n (key, value) pairs by key with a stable LSD radix sort, one byte
+// per pass. Passes over bytes that are the same in every key are skipped,
+// so hashes that only use the low bits of HashType cost fewer passes.
+// tmpKeys and tmpValues must have room for n entries.
+inline void radixSort(HashType *keys, uint32_t *values, size_t n, HashType *tmpKeys, uint32_t *tmpValues) {
+	const int Passes = sizeof(HashType);
+	std::vector<size_t> counts(Passes*256);
+
+	for (size_t j = 0; j < n; j++) {
+		HashType h = keys[j];
+		for (int p = 0; p < Passes; p++) {
+			counts[p*256 + ((h >> (8*p)) & 0xff)]++;
+		}
+	}
+
+	for (int p = 0; p < Passes; p++) {
+		size_t *count = &counts[p*256];
+		if (n == 0 || count[(keys[0] >> (8*p)) & 0xff] == n) {
+			continue;
+		}
+
+		size_t offset = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t c = count[b];
+			count[b] = offset;
+			offset += c;
+		}
+
+		for (size_t j = 0; j < n; j++) {
+			size_t dst = count[(keys[j] >> (8*p)) & 0xff]++;
+			tmpKeys[dst] = keys[j];
+			tmpValues[dst] = values[j];
+		}
+		memcpy(keys, tmpKeys, n*sizeof(HashType));
+		memcpy(values, tmpValues, n*sizeof(uint32_t));
+	}
+}
+
+// Read-only form of a bin in compressed sparse row layout: the distinct
+// hashes in ascending order, and for the i-th of them the ids
+// ids[offsets[i]] .. ids[offsets[i+1]-1], all packed in one array.
+//
+// A directory indexed by the top bits of the hashes narrows the binary
+// search down to the few keys sharing those bits.
+//
+// The bin also keeps a sorted list of split hashes, whose buckets were too
+// large and were replaced by smaller ones (see LSH::SetSplit).
+//
+// The arrays either live in the bin itself, after Build, or in memory
+// mapped from an index file, after Map. In the latter case nothing is copied.
+class frozenBin {
+	// Sizes of the arrays, as stored at the head of the bin in an index file.
+	struct header {
+		uint64_t nKeys;
+		uint64_t nIDs;
+		uint64_t nDirectory;
+		uint32_t shift;
+		uint32_t pad;
+		uint64_t nSplits;
+	};
+
+	std::vector<HashType> keyStore;
+	std::vector<uint32_t> offsetStore;
+	std::vector<PointID> idStore;
+	std::vector<uint32_t> directoryStore;
+	std::vector<HashType> splitStore;
+
+	const HashType *keys;
+	const uint32_t *offsets;  // nKeys+1 entries.
+	const PointID *ids;
+	const uint32_t *directory;  // keys with h>>shift == x are keys[directory[x]] .. keys[directory[x+1]-1].
+	const HashType *splits;  // sorted.
+	size_t nKeys;
+	size_t nIDs;
+	size_t nDirectory;
+	size_t nSplits;
+	int shift;
+
+	frozenBin(const frozenBin&) = delete;
+	frozenBin &operator=(const frozenBin&) = delete;
+
+	// The directory has at most 2^MaxDirectoryBits slots.
+	static const int MaxDirectoryBits = 24;
+
+	// Fills the directory with about one slot per key.
+	void buildDirectory() {
+		size_t size = this->keyStore.size();
+		int dbits = 0;
+		while (dbits < MaxDirectoryBits && ((size_t)2 << dbits) <= size) {
+			dbits++;
+		}
+		int kbits = 0;
+		HashType max = size > 0 ? this->keyStore.back() : 0;
+		while (kbits < (int)HashBits && (max >> kbits) != 0) {
+			kbits++;
+		}
+		this->shift = kbits > dbits ? kbits - dbits : 0;
+
+		size_t slots = (size_t)(max >> this->shift) + 1;
+		this->directoryStore.assign(slots + 1, 0);
+		size_t i = 0;
+		for (size_t x = 0; x <= slots; x++) {
+			while (i < size && (this->keyStore[i] >> this->shift) < x) {
+				i++;
+			}
+			this->directoryStore[x] = (uint32_t)i;
+		}
+	}
+
+	// Points the views at the arrays owned by the bin.
+	void view() {
+		this->keys = this->keyStore.data();
+		this->offsets = this->offsetStore.data();
+		this->ids = this->idStore.data();
+		this->directory = this->directoryStore.data();
+		this->splits = this->splitStore.data();
+		this->nSplits = this->splitStore.size();
+		this->nKeys = this->keyStore.size();
+		this->nIDs = this->idStore.size();
+		this->nDirectory = this->directoryStore.size();
+	}
+
+public:
+	frozenBin() : keys(nullptr), offsets(nullptr), ids(nullptr), directory(nullptr), splits(nullptr),
+		nKeys(0), nIDs(0), nDirectory(0), nSplits(0), shift(0) {
+	}
+
+	// Builds the bin from n (hash, id) pairs, putting each id in the bucket
+	// of its hash, and records the given split hashes. Pairs are sorted by
+	// hash in place; pairs with the same hash keep their relative order.
+	void Build(HashType *hashes, PointID *ids, size_t n, const std::vector<HashType> &splits = std::vector<HashType>()) {
+		std::vector<HashType> tmpKeys(n);
+		std::vector<PointID> tmpValues(n);
+		radixSort(hashes, ids, n, tmpKeys.data(), tmpValues.data());
+
+		this->keyStore.clear();
+		this->offsetStore.clear();
+		this->idStore.assign(ids, ids + n);
+		for (size_t j = 0; j < n; j++) {
+			if (j == 0 || hashes[j] != hashes[j-1]) {
+				this->keyStore.push_back(hashes[j]);
+				this->offsetStore.push_back((uint32_t)j);
+			}
+		}
+		this->offsetStore.push_back((uint32_t)n);
+		this->keyStore.shrink_to_fit();
+		this->offsetStore.shrink_to_fit();
+		this->splitStore = splits;
+		std::sort(this->splitStore.begin(), this->splitStore.end());
+		this->buildDirectory();
+		this->view();
+	}
+
+	// Returns the ids hashed to h and stores their number in n.
+	inline const PointID *Find(HashType h, size_t *n) const {
+		HashType x = h >> this->shift;
+		if (x + 1 >= this->nDirectory) {
+			*n = 0;
+			return nullptr;
+		}
+		size_t lo = this->directory[x], size = this->directory[x+1] - lo;
+		if (size == 0) {
+			*n = 0;
+			return nullptr;
+		}
+
+		// Branch-free lower bound.
+		const HashType *base = this->keys + lo;
+		while (size > 1) {
+			size_t half = size / 2;
+			base = base[half] < h ? base + half : base;
+			size -= half;
+		}
+		size_t i = (base - this->keys) + (*base < h);
+
+		if (i == this->nKeys || this->keys[i] != h) {
+			*n = 0;
+			return nullptr;
+		}
+		*n = this->offsets[i+1] - this->offsets[i];
+		return this->ids + this->offsets[i];
+	}
+
+	// Find(h) misses the cache on the directory slot of h, then on the keys
+	// and offsets it selects. PrefetchSlot(h) starts loading the former and,
+	// once it is loaded, PrefetchKeys(h) the latter, so that the misses of
+	// many lookups can overlap.
+	inline void PrefetchSlot(HashType h) const {
+		HashType x = h >> this->shift;
+		if (x + 1 < this->nDirectory) {
+			__builtin_prefetch(this->directory + x);
+		}
+	}
+
+	inline void PrefetchKeys(HashType h) const {
+		HashType x = h >> this->shift;
+		if (x + 1 < this->nDirectory) {
+			size_t lo = this->directory[x];
+			__builtin_prefetch(this->keys + lo);
+			__builtin_prefetch(this->offsets + lo);
+		}
+	}
+
+	// Returns true if the bucket of h was split.
+	inline bool IsSplit(HashType h) const {
+		return this->nSplits > 0 && std::binary_search(this->splits, this->splits + this->nSplits, h);
+	}
+
+	// Number of split hashes.
+	size_t Splits() const {
+		return this->nSplits;
+	}
+
+	// Number of distinct hashes.
+	size_t Buckets() const {
+		return this->nKeys;
+	}
+
+	// Returns the i-th distinct hash, i < Buckets(), in ascending order.
+	inline HashType Key(size_t i) const {
+		return this->keys[i];
+	}
+
+	// Returns the number of ids hashed to Key(i).
+	inline size_t Size(size_t i) const {
+		return this->offsets[i+1] - this->offsets[i];
+	}
+
+	// Returns the Size(i) ids hashed to Key(i).
+	inline const PointID *IDs(size_t i) const {
+		return this->ids + this->offsets[i];
+	}
+
+	// Memory used by the bin in bytes.
+	size_t Bytes() const {
+		return (this->nKeys + this->nSplits)*sizeof(HashType) +
+			(this->nKeys + 1 + this->nDirectory)*sizeof(uint32_t) +
+			this->nIDs*sizeof(PointID);
+	}
+
+	// Appends the bin to an index file, every array starting on a cache line.
+	// Returns false on error.
+	bool Write(FILE *f) const {
+		header h = {this->nKeys, this->nIDs, this->nDirectory, (uint32_t)this->shift, 0, this->nSplits};
+		return writeAligned(f, &h, sizeof(h)) &&
+			writeAligned(f, this->keys, this->nKeys*sizeof(HashType)) &&
+			writeAligned(f, this->offsets, (this->nKeys + 1)*sizeof(uint32_t)) &&
+			writeAligned(f, this->ids, this->nIDs*sizeof(PointID)) &&
+			writeAligned(f, this->directory, this->nDirectory*sizeof(uint32_t)) &&
+			writeAligned(f, this->splits, this->nSplits*sizeof(HashType));
+	}
+
+	// Makes the bin a view of one written by Write at data, which has size
+	// bytes available, for an index of nPoints points. Returns the number of
+	// bytes used, or 0 if the data is malformed. data must be cache line
+	// aligned and outlive the bin.
+	//
+	// Everything Find and IDs rely on is checked, reading the offsets, the
+	// ids and the directory once: the offsets run from 0 to nIDs without
+	// decreasing, the ids are less than nPoints and the directory slots
+	// select keys between 0 and nKeys without decreasing.
+	size_t Map(const char *data, size_t size, size_t nPoints) {
+		if (size < sizeof(header)) {
+			return 0;
+		}
+		header h;
+		memcpy(&h, data, sizeof(h));
+		if (h.shift >= HashBits || h.nKeys > h.nIDs || h.nIDs > (uint64_t)MaxPointID ||
+			h.nDirectory > ((uint64_t)1 << MaxDirectoryBits) + 1) {
+			return 0;
+		}
+
+		// Every block is checked against size before the next one is placed.
+		size_t used = alignedSize(sizeof(header));
+		size_t keysAt = used;
+		if (!nextBlock(&used, h.nKeys, sizeof(HashType), size)) {
+			return 0;
+		}
+		size_t offsetsAt = used;
+		if (!nextBlock(&used, h.nKeys + 1, sizeof(uint32_t), size)) {
+			return 0;
+		}
+		size_t idsAt = used;
+		if (!nextBlock(&used, h.nIDs, sizeof(PointID), size)) {
+			return 0;
+		}
+		size_t directoryAt = used;
+		if (!nextBlock(&used, h.nDirectory, sizeof(uint32_t), size)) {
+			return 0;
+		}
+		size_t splitsAt = used;
+		if (!nextBlock(&used, h.nSplits, sizeof(HashType), size)) {
+			return 0;
+		}
+
+		const uint32_t *offsets = (const uint32_t*)(data + offsetsAt);
+		if (offsets[0] != 0 || offsets[h.nKeys] != h.nIDs) {
+			return 0;
+		}
+		for (size_t i = 0; i < h.nKeys; i++) {
+			if (offsets[i] > offsets[i+1]) {
+				return 0;
+			}
+		}
+		const PointID *ids = (const PointID*)(data + idsAt);
+		for (size_t j = 0; j < h.nIDs; j++) {
+			if (ids[j] >= nPoints) {
+				return 0;
+			}
+		}
+		const uint32_t *directory = (const uint32_t*)(data + directoryAt);
+		for (size_t x = 0; x < h.nDirectory; x++) {
+			if (directory[x] > h.nKeys || (x > 0 && directory[x] < directory[x-1])) {
+				return 0;
+			}
+		}
+
+		this->keyStore.clear();
+		this->offsetStore.clear();
+		this->idStore.clear();
+		this->directoryStore.clear();
+		this->splitStore.clear();
+		this->keys = (const HashType*)(data + keysAt);
+		this->offsets = (const uint32_t*)(data + offsetsAt);
+		this->ids = (const PointID*)(data + idsAt);
+		this->directory = (const uint32_t*)(data + directoryAt);
+		this->splits = (const HashType*)(data + splitsAt);
+		this->nSplits = h.nSplits;
+		this->nKeys = h.nKeys;
+		this->nIDs = h.nIDs;
+		this->nDirectory = h.nDirectory;
+		this->shift = (int)h.shift;
+		return used;
+	}
+};
+
+};
+
+#endif  // SLASH_FROZENBIN_H
@@ -0,0 +1,174 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_INGEST_H
+#define SLASH_INGEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+#include "lsh.h"
+#include "mappedfile.h"
+
+namespace slash {
+
+// Building an index from a file of fixed-width records, one point per
+// record, without holding the whole dataset in memory besides the index.
+// Records are decoded into a batch of points, which is inserted before the
+// next batch is read, so at most batch points are held outside the index.
+//
+// A Decoder has a Size() giving the width of a record in bytes, and an
+// operator()(const char *record, FeatureVector *p) decoding a record into p,
+// which returns false if the record is malformed.
+
+// Decodes records that hold the bytes of a FeatureVector, like the points
+// of a file written by LSH::Save.
+template <class FeatureVector>
+struct RawRecord {
+	static_assert(std::is_trivially_copyable<FeatureVector>::value, "FeatureVector must be trivially copyable to be read raw");
+
+	size_t Size() const {
+		return sizeof(FeatureVector);
+	}
+
+	bool operator()(const char *record, FeatureVector *p) const {
+		memcpy((void*)p, record, sizeof(FeatureVector));
+		return true;
+	}
+};
+
+// Decodes records of d floats into a FeatureVector constructed from them,
+// like DenseVector. If header is set, every record starts with d as a
+// 32-bit integer, as in the .fvecs format.
+template <class FeatureVector>
+struct FloatRecord {
+	// Largest d decoded.
+	static const int MaxFloats = 4096;
+
+	int d;
+	bool header;
+
+	size_t Size() const {
+		return (this->header ? sizeof(int32_t) : 0) + this->d*sizeof(float);
+	}
+
+	bool operator()(const char *record, FeatureVector *p) const {
+		if (this->header) {
+			int32_t d;
+			memcpy(&d, record, sizeof(d));
+			if (d != this->d) {
+				return false;
+			}
+			record += sizeof(d);
+		}
+		float x[MaxFloats];
+		if (this->d > MaxFloats) {
+			return false;
+		}
+		memcpy(x, record, this->d*sizeof(float));
+		*p = FeatureVector(x);
+		return true;
+	}
+};
+
+// Inserts the records of the file at path into index, batch of them at a
+// time. The file is mapped rather than read, and the pages of each batch
+// are released once it is inserted. Room for all the points is reserved
+// up front, and the buckets are shrunk to fit once at the end. Returns false if the file cannot be mapped, its size is not a
+// multiple of the record size, or a record is malformed; the records
+// before a malformed one are inserted. If inserted is not nullptr, the
+// number of points inserted is stored in it.
+template <class FeatureVector, class Hasher, class Decoder>
+bool InsertFile(LSH<FeatureVector, Hasher> &index, const char *path, const Decoder &decode, size_t batch = 65536, size_t *inserted = nullptr) {
+	size_t done = 0;
+	if (inserted != nullptr) {
+		*inserted = 0;
+	}
+	MappedFile file;
+	size_t width = decode.Size();
+	if (width == 0 || batch == 0 || !file.Open(path) || file.Size() % width != 0) {
+		return false;
+	}
+	size_t n = file.Size() / width;
+	index.Reserve(index.Size() + n);
+
+	std::vector<FeatureVector> points(n < batch ? n : batch);
+	bool ok = true;
+	for (size_t j = 0; ok && j < n; j += batch) {
+		size_t m = n - j < batch ? n - j : batch, decoded = 0;
+		const char *record = file.Data() + j*width;
+		for (; decoded < m; decoded++, record += width) {
+			if (!decode(record, &points[decoded])) {
+				ok = false;
+				break;
+			}
+		}
+		index.Insert(points.data(), decoded);
+		file.Release(j*width, m*width);
+		done += decoded;
+	}
+	index.ShrinkToFit();
+	if (inserted != nullptr) {
+		*inserted = done;
+	}
+	return ok;
+}
+
+// Same as InsertFile, reading the records from f, for example stdin, until
+// its end. Returns false on a read error, a trailing partial record or a
+// malformed record; the records before it are inserted.
+template <class FeatureVector, class Hasher, class Decoder>
+bool InsertStream(LSH<FeatureVector, Hasher> &index, FILE *f, const Decoder &decode, size_t batch = 65536, size_t *inserted = nullptr) {
+	size_t done = 0;
+	if (inserted != nullptr) {
+		*inserted = 0;
+	}
+	size_t width = decode.Size();
+	if (width == 0 || batch == 0) {
+		return false;
+	}
+
+	std::vector<char> buffer(batch*width);
+	std::vector<FeatureVector> points(batch);
+	bool ok = true;
+	for (;;) {
+		size_t bytes = fread(buffer.data(), 1, buffer.size(), f);
+		size_t m = bytes / width, decoded = 0;
+		for (const char *record = buffer.data(); decoded < m; decoded++, record += width) {
+			if (!decode(record, &points[decoded])) {
+				ok = false;
+				break;
+			}
+		}
+		index.Insert(points.data(), decoded);
+		done += decoded;
+		if (!ok || bytes < buffer.size()) {
+			ok = ok && bytes % width == 0 && !ferror(f);
+			break;
+		}
+	}
+	index.ShrinkToFit();
+	if (inserted != nullptr) {
+		*inserted = done;
+	}
+	return ok;
+}
+
+};
+
+#endif  // SLASH_INGEST_H
@@ -19,27 +19,35 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <type_traits>
 #include <vector>
 #include <google/sparse_hash_map>
 #include "types.h"
 #include "querycontext.h"
+#include "stats.h"
+#include "parallel.h"
+#include "frozenbin.h"
+#include "mappedfile.h"
 
 namespace slash {
 
-template <class FeatureVector>
 class bin : public
-google::sparse_hash_map<HashType, std::vector<const FeatureVector*> > {
-};
-
-template <class FeatureVector>
-class hashCache : public
-google::sparse_hash_map<const FeatureVector*, HashType*, FeatureVector, FeatureVector> {
+google::sparse_hash_map<HashType, std::vector<PointID> > {
 };
 
 
 // Class lsh implements Locality-Sensitive Hashing algorithm.
 // A. Gionis, P. Indyk and R. Motwani, ``Similarity Search in High Dimensions via Hashing'',
 // Proc. 25th International Conference on Very Large Data Bases, VLDB1999, pp.518-529, 1999.
+//
+// Inserted points are copied into the index and identified by dense ids
+// 0, 1, 2, ... in insertion order.
 template <class FeatureVector, class Hasher>
 class LSH {
  public:
@@ -48,85 +56,1068 @@ class LSH {
 	// d is the dimension of the feature space.
 	// k is the number of elementary hash functions (h) to be concataneted to obtain a reliable enough hash function (g). LSH queries becomes more selective with increasing k, due to the reduced the probability of collision.
 	// L is the number of "copies" of the bins (with a different random matrices). Increasing L will increase the number of points the should be scanned linearly during query.
-	// cacheHashes enables caching of hashes, which speeds up queries at the expense of extra memory. It also reduces the strain on memory allocator.
-	LSH(int d, int k, int L, Hasher *hasher) : d(d), k(k), l(L), hasher(hasher) {
-		this->bins = new bin<FeatureVector>[this->l];
+	LSH(int d, int k, int L, Hasher *hasher) : d(d), k(k), l(L), threads(1), probes(1), batchGroup(BatchGroup), hasher(hasher), ownsHasher(false),
+		splitter(nullptr), splitThreshold(0), splitDepth(0), splitK(0),
+		frozen(nullptr), points(nullptr), hashes(nullptr), norms(nullptr), nPoints(0), file(nullptr) {
+		assert(L > 0);
+		this->bins = new bin[(size_t)this->l];
 	}
 	
 	~LSH() {
-		for(auto &item: this->cache) {
-			delete [] item.second;
-		}
 		delete [] this->bins;
+		delete [] this->frozen;
+		if (this->ownsHasher) {
+			delete this->hasher;
+		}
+		delete this->splitter;
+		delete this->file;
+	}
+
+	// Sets the number of threads used by Insert, Freeze and QueryBatch.
+	// n <= 0 uses one thread per hardware thread. The default is 1. The
+	// resulting index does not depend on the number of threads.
+	void SetThreads(int n) {
+		this->threads = threadCount(n);
+	}
+
+	// Sets the number of buckets Query visits in each table (default 1). With
+	// more than one, Query also visits the buckets that Hasher::HashProbes
+	// ranks as the next most likely to hold neighbors, which reaches a
+	// given recall with far fewer tables.
+	void SetProbes(int probes) {
+		this->probes = probes > 1 ? probes : 1;
+	}
+
+	// Sets the number of queries QueryBatch moves through its stages
+	// together (default BatchGroup). Results do not depend on it.
+	void SetBatchGroup(size_t n) {
+		this->batchGroup = n > 1 ? n : 1;
+	}
+
+	// Makes Freeze split every bucket of more than threshold ids into smaller
+	// ones, which bounds the number of candidates a query meets in a table
+	// when the data is skewed, without raising k for the whole table.
+	//
+	// The ids of an overloaded bucket are hashed by splitK more elementary
+	// hashes, and move to the child buckets keyed by the hash of the bucket
+	// combined with that hash. Children that are still too large are split
+	// again, down to depth levels. Queries landing on a split bucket hash
+	// the query point the same way and follow it down to its child.
+	// Every table and level has its own elementary hashes, drawn from a
+	// Hasher(d, splitK, L*depth) owned by the index. A threshold of 0 turns
+	// splitting off, the default. Must be called before Freeze.
+	void SetSplit(size_t threshold, int depth = 4, int splitK = 1) {
+		assert(this->frozen == nullptr);
+		delete this->splitter;
+		this->splitter = nullptr;
+		this->splitThreshold = threshold;
+		this->splitDepth = threshold > 0 ? depth : 0;
+		this->splitK = splitK;
+		if (this->splitDepth > 0) {
+			this->splitter = new Hasher(this->d, splitK, this->l*this->splitDepth);
+		}
 	}
 
 	// Hashes given points from the feature space, making them avaiable
-	// for queries.
-	// A FeatureVector must not be inserted more than once.
-	void Insert(const std::vector<FeatureVector> &points) {
-		size_t nPoints = points.size();
-		for (size_t j = 0; j < nPoints; j++) {
-			const FeatureVector& p = points[j];
-
-			
-			assert(this->cache[&p] == nullptr);
-			/* if (this->cache[&p] != nullptr) {
-				continue;
-			} */
-
-			auto g = new HashType[this->l];
-			this->cache[&p] = g;
-			this->hasher->Hash(p, g);
+	// for queries. The points are copied into the index; the i-th of them
+	// gets the id returned + i. Points can be inserted in any number of
+	// calls, see also InsertFile and InsertStream in ingest.h, and
+	// ShrinkToFit.
+	// Points must not be inserted after Freeze.
+	//
+	// Hashing is split across threads by contiguous ranges of points, then
+	// every bin is filled by a single thread walking the points in order,
+	// so buckets end up exactly as a serial insert would leave them.
+	PointID Insert(const FeatureVector *points, size_t nPoints) {
+		assert(this->frozen == nullptr);
+		assert(this->nPoints + nPoints <= (size_t)MaxPointID);
+
+		size_t l = this->l;
+		size_t first = this->nPoints;
+		this->pointStore.insert(this->pointStore.end(), points, points + nPoints);
+		this->hashStore.resize((first + nPoints)*l);
+		this->normStore.resize(first + nPoints);
+		this->points = this->pointStore.data();
+		this->hashes = this->hashStore.data();
+		this->norms = this->normStore.data();
+		this->nPoints = first + nPoints;
+
+		const FeatureVector *p = this->points + first;
+		HashType *g = this->hashStore.data() + first*l;
+		float *norm = this->normStore.data() + first;
+		parallelFor(this->threads, nPoints, [&](size_t begin, size_t end) {
+			this->hasher->HashBatch(p + begin, end - begin, g + begin*l);
+			for (size_t j = begin; j < end; j++) {
+				norm[j] = p[j].Norm();
+			}
+		});
+
+		parallelFor(this->threads, l, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				auto &b = this->bins[i];
+				for (size_t j = 0; j < nPoints; j++) {
+					b[g[j*l + i]].push_back((PointID)(first + j));
+				}
+			}
+		});
+
+		return (PointID)first;
+	}
+
+	PointID Insert(const std::vector<FeatureVector> &points) {
+		return this->Insert(points.data(), points.size());
+	}
+
+	// Releases the spare capacity of every bucket, left by the growth of the
+	// bucket vectors during Insert. Call it once after the last Insert of an
+	// index that will be queried without Freeze; shrinking after every batch
+	// would reallocate the busiest buckets again and again. Freeze replaces
+	// the buckets and does not need it.
+	void ShrinkToFit() {
+		assert(this->frozen == nullptr);
+		parallelFor(this->threads, this->l, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				for (auto &item: this->bins[i]) {
+					item.second.shrink_to_fit();
+				}
+			}
+		});
+	}
+
+	// Makes room for n points in total, so that inserting up to n points in
+	// several calls does not move the points already inserted.
+	void Reserve(size_t n) {
+		assert(this->frozen == nullptr);
+		this->pointStore.reserve(n);
+		this->hashStore.reserve(n*this->l);
+		this->normStore.reserve(n);
+		this->points = this->pointStore.data();
+		this->hashes = this->hashStore.data();
+		this->norms = this->normStore.data();
+	}
+
+	// Converts every bin into a read-only compressed sparse row layout: sorted
+	// distinct hashes, an offsets array and one packed array of ids. The
+	// layout is built by radix sorting the (hash, id) pairs of each bin and
+	// keeps the order of ids within a bucket, so queries return the same
+	// results as before. Probes become a branch-free binary search and a scan
+	// of contiguous memory. The index cannot be inserted into afterwards.
+	//
+	// Overloaded buckets are split here, see SetSplit.
+	void Freeze() {
+		if (this->frozen != nullptr) {
+			return;
+		}
+
+		size_t n = this->nPoints;
+		assert(this->l > 0);
+		this->frozen = new frozenBin[(size_t)this->l];
+
+		parallelFor(this->threads, this->l, [&](size_t begin, size_t end) {
+			std::vector<HashType> hashes(n);
+			std::vector<PointID> ids(n);
+			for (size_t i = begin; i < end; i++) {
+				for (size_t j = 0; j < n; j++) {
+					hashes[j] = this->hashes[j*this->l + i];
+					ids[j] = (PointID)j;
+				}
+				std::vector<HashType> splits;
+				if (this->splitDepth > 0) {
+					this->split(i, hashes.data(), ids.data(), n, splits);
+				}
+				this->frozen[i].Build(hashes.data(), ids.data(), n, splits);
+				bin().swap(this->bins[i]);
+			}
+		});
+	}
+
+	// Writes the index to a file at path, which can be mapped back with Open.
+	// The index must be frozen. Returns false on error.
+	//
+	// The file holds, each part starting on a cache line: a header, the
+	// hasher as written by Hasher::Write, the hasher splitting buckets if any,
+	// the points, their hashes, their norms and the L frozen bins.
+	// FeatureVector must be trivially copyable, as points are stored as raw
+	// bytes. The file is only readable on machines with the same byte order
+	// and type sizes.
+	bool Save(const char *path) const {
+		static_assert(std::is_trivially_copyable<FeatureVector>::value, "FeatureVector must be trivially copyable to be saved");
+
+		if (this->frozen == nullptr) {
+			return false;
+		}
+
+		FILE *f = fopen(path, "wb");
+		if (f == nullptr) {
+			return false;
+		}
+
+		fileHeader h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, "SLASHIDX", sizeof(h.magic));
+		h.version = FileVersion;
+		h.byteOrder = FileByteOrder;
+		h.d = this->d;
+		h.k = this->k;
+		h.l = this->l;
+		h.pointSize = sizeof(FeatureVector);
+		h.nPoints = this->nPoints;
+		h.splitThreshold = this->splitThreshold;
+		h.splitDepth = this->splitDepth;
+		h.splitK = this->splitK;
+
+		bool ok = writeAligned(f, &h, sizeof(h));
+		long hasherAt = ftell(f);
+		ok = ok && this->hasher->Write(f);
+		h.hasherBytes = ftell(f) - hasherAt;
+		if (this->splitter != nullptr) {
+			long splitterAt = ftell(f);
+			ok = ok && this->splitter->Write(f);
+			h.splitterBytes = ftell(f) - splitterAt;
+		}
+		ok = ok && writeAligned(f, this->points, this->nPoints*sizeof(FeatureVector));
+		ok = ok && writeAligned(f, this->hashes, this->nPoints*this->l*sizeof(HashType));
+		ok = ok && writeAligned(f, this->norms, this->nPoints*sizeof(float));
+		for (int i = 0; ok && i < this->l; i++) {
+			ok = this->frozen[i].Write(f);
+		}
+
+		// Now that the size of the hasher is known.
+		ok = ok && fseek(f, 0, SEEK_SET) == 0 && writeAligned(f, &h, sizeof(h));
+		return fclose(f) == 0 && ok;
+	}
+
+	// Maps an index written by Save read-only into memory and returns it, or
+	// nullptr if the file cannot be read or is not a valid index for these
+	// FeatureVector and Hasher types. Nothing is deserialized: the hasher,
+	// the points and the bins are used in place, and processes opening the
+	// same file share its pages. Open checks every size against the file,
+	// the hashers against the header and the bins as in frozenBin::Map, so
+	// a malformed file is rejected rather than read out of bounds; this
+	// reads the ids of every bin once.
+	// Hasher must provide a static Map function returning a new hasher that
+	// views a block written by Hasher::Write, and D, K and L.
+	// The returned index is frozen and owns its hasher.
+	static LSH *Open(const char *path) {
+		static_assert(std::is_trivially_copyable<FeatureVector>::value, "FeatureVector must be trivially copyable to be opened");
+
+		MappedFile *file = new MappedFile();
+		if (!file->Open(path) || file->Size() < sizeof(fileHeader)) {
+			delete file;
+			return nullptr;
+		}
 
-			for (size_t i = 0; i < (size_t)this->l; i++) {
-				this->bins[i][g[i]].push_back(&p);
+		const char *data = file->Data();
+		size_t size = file->Size();
+		fileHeader h;
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, "SLASHIDX", sizeof(h.magic)) != 0 || h.version != FileVersion ||
+			h.byteOrder != FileByteOrder || h.pointSize != sizeof(FeatureVector) ||
+			h.l == 0 || h.nPoints > (uint64_t)MaxPointID) {
+			delete file;
+			return nullptr;
+		}
+
+		size_t at = alignedSize(sizeof(fileHeader));
+		size_t splitterAt = at;
+		bool ok = nextBlock(&splitterAt, h.hasherBytes, 1, size);
+		size_t pointsAt = splitterAt;
+		ok = ok && nextBlock(&pointsAt, h.splitterBytes, 1, size);
+		size_t hashesAt = pointsAt;
+		ok = ok && nextBlock(&hashesAt, h.nPoints, sizeof(FeatureVector), size);
+		size_t normsAt = hashesAt;
+		ok = ok && nextBlock(&normsAt, h.nPoints, (size_t)h.l*sizeof(HashType), size);
+		size_t binsAt = normsAt;
+		ok = ok && nextBlock(&binsAt, h.nPoints, sizeof(float), size);
+
+		// The hasher must hash the way the header says: L tables of k
+		// elementary hashes, k chopped down like the constructor does.
+		Hasher *hasher = ok ? Hasher::Map(data + at, h.hasherBytes) : nullptr;
+		if (hasher == nullptr || (uint32_t)hasher->D() != h.d || (uint32_t)hasher->L() != h.l ||
+			(int64_t)hasher->K() != std::min<int64_t>(h.k, Hasher::MaxK(hasher->D()))) {
+			delete hasher;
+			delete file;
+			return nullptr;
+		}
+
+		LSH *lsh = new LSH(h.d, h.k, h.l, hasher);
+		lsh->ownsHasher = true;
+		lsh->file = file;
+		if (h.splitDepth > 0) {
+			// The splitter is a Hasher(d, splitK, L*depth), see SetSplit.
+			Hasher *splitter = Hasher::Map(data + splitterAt, h.splitterBytes);
+			lsh->splitter = splitter;
+			if (splitter == nullptr || splitter->D() != hasher->D() ||
+				(uint64_t)splitter->L() != (uint64_t)h.l*h.splitDepth ||
+				(int64_t)splitter->K() != std::min<int64_t>(h.splitK, Hasher::MaxK(hasher->D()))) {
+				delete lsh;
+				return nullptr;
 			}
+			lsh->splitThreshold = h.splitThreshold;
+			lsh->splitDepth = h.splitDepth;
+			lsh->splitK = h.splitK;
 		}
+		lsh->points = (const FeatureVector*)(data + pointsAt);
+		lsh->hashes = (const HashType*)(data + hashesAt);
+		lsh->norms = (const float*)(data + normsAt);
+		lsh->nPoints = h.nPoints;
+		lsh->frozen = new frozenBin[(size_t)lsh->l];
 
-		for (size_t i = 0; i < (size_t)this->l; i++) {
-			for (auto &item: bins[i]) {
-				item.second.shrink_to_fit();
+		at = binsAt;
+		for (int i = 0; i < lsh->l; i++) {
+			size_t used = lsh->frozen[i].Map(data + at, size - at, lsh->nPoints);
+			if (used == 0) {
+				delete lsh;
+				return nullptr;
 			}
+			at += used;
 		}
+		return lsh;
 	}
 
-	// Returns nearest neighbors of p; at most limit entries.
+	// Returns nearest neighbors of the inserted point id, excluding itself;
+	// at most limit entries, most similar first.
 	// Runs in sublinear time O(n^ρ). The exponent ρ depends on the hashing function,
 	// and the parameters d, k, L.
-	// p must be Insert'ed before the Query.
-	std::vector<FeatureVector> Query(const FeatureVector &p, int limit, size_t *linearSearchSize = nullptr) {
-		QueryContext<FeatureVector> c(limit+1);
-		
-		auto g = this->cache[&p];
-		if (g == nullptr) {
-			return c.Neighbors();
+	// The hashes of id were computed by Insert, so no hashing is done unless
+	// more than one probe per table is used.
+	// If stats is not nullptr, the work done is added to it; stats->candidates
+	// is the size of the linear search.
+	std::vector<Neighbor> Query(PointID id, int limit, QueryStats *stats = nullptr) const {
+		contextHold hold(limit, this->nPoints);
+		QueryContext &c = hold.c;
+		this->search(this->points[id], id, c, topSink{this, c}, stats);
+		return c.Neighbors();
+	}
+
+	// Returns nearest neighbors of p, which need not be inserted; at most limit
+	// entries, most similar first. p is hashed on the fly.
+	// If stats is not nullptr, the work done is added to it.
+	std::vector<Neighbor> Query(const FeatureVector &p, int limit, QueryStats *stats = nullptr) const {
+		contextHold hold(limit, this->nPoints);
+		QueryContext &c = hold.c;
+		this->search(p, MaxPointID, c, topSink{this, c}, stats);
+		return c.Neighbors();
+	}
+
+	// Same as above, with the hashes of p already in g, as computed by
+	// Hasher::Hash, or by Hasher::HashProbes with the number of probes set by
+	// SetProbes. Lets indexes sharing a hasher share the hashing of a query.
+	std::vector<Neighbor> Query(const FeatureVector &p, const HashType *g, int limit, QueryStats *stats = nullptr) const {
+		contextHold hold(limit, this->nPoints);
+		QueryContext &c = hold.c;
+		this->scan(p, g, this->probes, MaxPointID, c, topSink{this, c}, stats);
+		return c.Neighbors();
+	}
+
+	// Same as Query, storing the neighbors in out, which has room for limit
+	// of them, rather than in a new vector. Returns their number.
+	//
+	// With a single probe per table, this allocates no memory once the query
+	// context of the calling thread has grown to the index and to limit.
+	int QueryInto(PointID id, int limit, Neighbor *out, QueryStats *stats = nullptr) const {
+		contextHold hold(limit, this->nPoints);
+		QueryContext &c = hold.c;
+		this->search(this->points[id], id, c, topSink{this, c}, stats);
+		return c.CopyNeighbors(out);
+	}
+
+	int QueryInto(const FeatureVector &p, int limit, Neighbor *out, QueryStats *stats = nullptr) const {
+		contextHold hold(limit, this->nPoints);
+		QueryContext &c = hold.c;
+		this->search(p, MaxPointID, c, topSink{this, c}, stats);
+		return c.CopyNeighbors(out);
+	}
+
+	// Calls f(id, similarity) for every point at least threshold similar to
+	// p among the candidates of p, once per point, in no particular order.
+	// Returns the number of calls. Like QueryInto, allocates no memory with a
+	// single probe per table. f may query the index itself, for example to
+	// cluster the points it is given.
+	template <class F>
+	size_t QueryRange(const FeatureVector &p, float threshold, const F &f, QueryStats *stats = nullptr) const {
+		size_t found = 0;
+		contextHold hold(0, this->nPoints);
+		QueryContext &c = hold.c;
+		this->search(p, MaxPointID, c, rangeSink<F>{f, threshold, &found}, stats);
+		return found;
+	}
+
+	// Same as above for the inserted point id, excluding itself.
+	template <class F>
+	size_t QueryRange(PointID id, float threshold, const F &f, QueryStats *stats = nullptr) const {
+		size_t found = 0;
+		contextHold hold(0, this->nPoints);
+		QueryContext &c = hold.c;
+		this->search(this->points[id], id, c, rangeSink<F>{f, threshold, &found}, stats);
+		return found;
+	}
+
+	// Returns the number of buckets Query visits in each table.
+	inline int Probes() const {
+		return this->probes;
+	}
+
+	// Answers n queries at once, storing in results[j] what
+	// Query(queries[j], limit, stats) would return. The vectors in results
+	// keep their memory, so reusing them across calls allocates nothing.
+	//
+	// A single query is a chain of dependent cache misses: the bucket
+	// directory, the keys, the ids, then the points. QueryBatch moves groups
+	// of queries (see SetBatchGroup) through each of these stages together,
+	// prefetching what the next stage reads, so the misses of different
+	// queries overlap. Groups are split across the threads set by SetThreads.
+	void QueryBatch(const FeatureVector *queries, size_t n, int limit, std::vector<Neighbor> *results, QueryStats *stats = nullptr) const {
+		std::mutex mutex;
+		parallelFor(this->threads, n, [&](size_t begin, size_t end) {
+			QueryStats local;
+			batchScratch s;
+			size_t group = this->batchGroup;
+			for (size_t j = begin; j < end; j += group) {
+				size_t m = end - j < group ? end - j : group;
+				this->queryGroup(queries + j, m, limit, results + j, s, &local);
+			}
+			if (stats != nullptr) {
+				std::lock_guard<std::mutex> lock(mutex);
+				*stats += local;
+			}
+		});
+	}
+
+	std::vector<std::vector<Neighbor> > QueryBatch(const std::vector<FeatureVector> &queries, int limit, QueryStats *stats = nullptr) const {
+		std::vector<std::vector<Neighbor> > results(queries.size());
+		this->QueryBatch(queries.data(), queries.size(), limit, results.data(), stats);
+		return results;
+	}
+
+	// Calls f(a, b, similarity) for every pair of inserted points a < b that
+	// share a bucket in some table and are at least threshold similar, once
+	// per pair. Returns the number of calls. These are the pairs QueryRange
+	// finds for every point, without hashing or visiting any pair twice.
+	//
+	// The buckets of every table are walked directly, and the pairs of a
+	// bucket generated with a < b. A pair is left to the first table in
+	// which the two points share a bucket, which their hashes tell. The
+	// partners of a point in a bucket are scored together by
+	// FeatureVector::SimilarityBatch. Buckets are shared out among the
+	// threads set by SetThreads, largest first. Every thread hands its pairs
+	// to f in blocks under a lock, so f need not be thread-safe; the pairs
+	// come in no particular order. The number of probes does not matter.
+	//
+	// If stats is not nullptr, the buckets walked, the pairs in them
+	// (candidates), the pairs left to an earlier table (duplicates) and the
+	// similarities computed (evaluations) are added to it.
+	template <class F>
+	size_t SelfJoin(float threshold, const F &f, QueryStats *stats = nullptr) const {
+		size_t l = this->l;
+
+		// The bucket of every point in every table, following splits.
+		const HashType *keys = this->hashes;
+		std::vector<HashType> leaves;
+		if (this->splitDepth > 0 && this->frozen != nullptr) {
+			leaves.resize(this->nPoints*l);
+			parallelFor(this->threads, this->nPoints, [&](size_t begin, size_t end) {
+				std::vector<HashType> sub(l*this->splitDepth);
+				for (size_t j = begin; j < end; j++) {
+					bool hashed = false;
+					for (size_t i = 0; i < l; i++) {
+						leaves[j*l + i] = this->leaf(i, this->hashes[j*l + i], this->points[j], sub.data(), &hashed);
+					}
+				}
+			});
+			keys = leaves.data();
+		}
+
+		std::vector<joinTask> tasks;
+		for (size_t i = 0; i < l; i++) {
+			if (this->frozen != nullptr) {
+				for (size_t b = 0; b < this->frozen[i].Buckets(); b++) {
+					if (this->frozen[i].Size(b) > 1) {
+						tasks.push_back(joinTask{i, this->frozen[i].IDs(b), this->frozen[i].Size(b)});
+					}
+				}
+			} else {
+				for (auto &item: this->bins[i]) {
+					if (item.second.size() > 1) {
+						tasks.push_back(joinTask{i, item.second.data(), item.second.size()});
+					}
+				}
+			}
+		}
+		// The cost of a bucket grows with the square of its size; starting
+		// with the largest keeps one from finishing last on its own.
+		std::sort(tasks.begin(), tasks.end(), [](const joinTask &a, const joinTask &b) {
+			return a.n > b.n;
+		});
+
+		std::atomic<size_t> next(0);
+		std::mutex mutex;
+		size_t found = 0;
+		QueryStats total;
+		parallelFor(this->threads, this->threads, [&](size_t, size_t) {
+			std::vector<joinPair> pairs;
+			QueryStats local;
+			auto flush = [&]() {
+				std::lock_guard<std::mutex> lock(mutex);
+				for (auto &p: pairs) {
+					f(p.a, p.b, p.similarity);
+				}
+				found += pairs.size();
+				pairs.clear();
+			};
+			for (size_t t; (t = next++) < tasks.size(); ) {
+				this->joinBucket(tasks[t], keys, threshold, pairs, &local);
+				if (pairs.size() >= JoinBlock) {
+					flush();
+				}
+			}
+			flush();
+			std::lock_guard<std::mutex> lock(mutex);
+			total += local;
+		});
+
+		if (stats != nullptr) {
+			*stats += total;
 		}
+		return found;
+	}
 
-		for (size_t i = 0; i < (size_t)this->l; i++) {
-			auto &v = bins[i][g[i]];
-			size_t vSize = v.size();
+	// Returns the inserted point with the given id.
+	inline const FeatureVector &Point(PointID id) const {
+		return this->points[id];
+	}
 
-			if (linearSearchSize != nullptr) {
-				*linearSearchSize += vSize;
+	// Returns the number of inserted points.
+	inline size_t Size() const {
+		return this->nPoints;
+	}
+
+	// Memory used by the points, their hashes and norms, and the tables, in
+	// bytes; the hasher is not counted. Before Freeze, buckets are counted
+	// by their keys and id vectors, leaving out the overhead of the hash maps.
+	size_t Bytes() const {
+		size_t bytes = this->nPoints*(sizeof(FeatureVector) + this->l*sizeof(HashType) + sizeof(float));
+		for (int i = 0; i < this->l; i++) {
+			bytes += this->tableBytes(i);
+		}
+		return bytes;
+	}
+
+	// Returns the shape of every table: a histogram of the bucket sizes and
+	// the largest buckets, up to largest of them, along with the memory
+	// used by the parts of the index, counted like in Bytes. It walks every
+	// bucket, so it is meant for monitoring, not for every query.
+	IndexStats Stats(size_t largest = 8) const {
+		IndexStats s;
+		s.points = this->nPoints;
+		s.pointBytes = this->nPoints*(sizeof(FeatureVector) + sizeof(float));
+		s.hashBytes = this->nPoints*this->l*sizeof(HashType);
+		s.tables.resize(this->l);
+		for (int i = 0; i < this->l; i++) {
+			TableStats &t = s.tables[i];
+			if (this->frozen != nullptr) {
+				for (size_t b = 0; b < this->frozen[i].Buckets(); b++) {
+					t.Add(this->frozen[i].Key(b), this->frozen[i].Size(b), largest);
+				}
+				t.splits = this->frozen[i].Splits();
+			} else {
+				for (auto &item: this->bins[i]) {
+					t.Add(item.first, item.second.size(), largest);
+				}
 			}
+			t.Finish();
+			t.bytes = this->tableBytes(i);
+			s.binBytes += t.bytes;
+		}
+		return s;
+	}
+
+ private:
+	// Head of an index file written by Save.
+	struct fileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t d;
+		uint32_t k;
+		uint32_t l;
+		uint32_t pointSize;  // sizeof(FeatureVector)
+		uint64_t nPoints;
+		uint64_t hasherBytes;  // size of the block written by Hasher::Write.
+		uint64_t splitThreshold;
+		uint32_t splitDepth;  // 0 if buckets are not split.
+		uint32_t splitK;
+		uint64_t splitterBytes;  // size of the block written by the splitter's Write.
+	};
+
+	// Changes with the layout, and with the hashes the same hasher gives,
+	// since the stored hashes must match those of queries.
+	static const uint32_t FileVersion = 4;
+	static const uint32_t FileByteOrder = 0x01020304;
+
+	// Number of hashes up to which Query keeps the hashes of a probe on the stack.
+	static const int MaxStackHashes = 256;
+
+	// Returns the key of the child of bucket h for the elementary hashes sub.
+	// The splitmix64 finalizer spreads the children of different buckets
+	// apart, so they do not meet in practice.
+	static inline HashType splitKey(HashType h, HashType sub) {
+		HashType x = h ^ (sub + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	// Moves the n (hash, id) pairs of table i in overloaded buckets to child
+	// buckets, level by level, and appends the hashes of the split buckets to
+	// splits. The pairs end up sorted by hash, with ids in ascending order
+	// within a bucket.
+	void split(size_t i, HashType *hashes, PointID *ids, size_t n, std::vector<HashType> &splits) const {
+		std::vector<HashType> tmpKeys(n);
+		std::vector<PointID> tmpValues(n);
+		radixSort(hashes, ids, n, tmpKeys.data(), tmpValues.data());
+
+		for (int level = 0; level < this->splitDepth; level++) {
+			bool changed = false;
+			for (size_t a = 0, b; a < n; a = b) {
+				for (b = a+1; b < n && hashes[b] == hashes[a]; b++) {
+				}
+				if (b - a <= this->splitThreshold) {
+					continue;
+				}
+				HashType h = hashes[a];
+				if (std::binary_search(splits.begin(), splits.end(), h)) {
+					continue;  // a child meeting a split bucket; left as it is.
+				}
+				splits.insert(std::upper_bound(splits.begin(), splits.end(), h), h);
+				// Only the splitter table of this table and level is needed.
+				int table = (int)(i*this->splitDepth + level);
+				for (size_t j = a; j < b; j++) {
+					hashes[j] = splitKey(h, this->splitter->HashTable(this->points[ids[j]], table));
+				}
+				changed = true;
+			}
+			if (!changed) {
+				break;
+			}
+			radixSort(hashes, ids, n, tmpKeys.data(), tmpValues.data());
+		}
+	}
+
+	// Returns the bucket of p in table i, starting from the bucket h and
+	// following splits down. sub receives the hashes of p by the splitter,
+	// computed on first use and flagged by hashed.
+	inline HashType leaf(size_t i, HashType h, const FeatureVector &p, HashType *sub, bool *hashed) const {
+		for (int level = 0; level < this->splitDepth && this->frozen[i].IsSplit(h); level++) {
+			if (!*hashed) {
+				this->splitter->Hash(p, sub);
+				*hashed = true;
+			}
+			h = splitKey(h, sub[i*this->splitDepth + level]);
+		}
+		return h;
+	}
+
+	// Memory used by table i, as counted by Bytes.
+	size_t tableBytes(int i) const {
+		if (this->frozen != nullptr) {
+			return this->frozen[i].Bytes();
+		}
+		size_t bytes = 0;
+		for (auto &item: this->bins[i]) {
+			bytes += sizeof(item) + item.second.capacity()*sizeof(PointID);
+		}
+		return bytes;
+	}
+
+	// Scans the buckets of p for candidates and passes them to sink, skipping
+	// self. If self is an inserted point and a single probe is used, its
+	// hashes computed by Insert are used; otherwise p is hashed.
+	template <class Sink>
+	void search(const FeatureVector &p, PointID self, QueryContext &c, const Sink &sink, QueryStats *stats) const {
+		if (self != MaxPointID && this->probes == 1) {
+			this->scan(p, this->hashes + (size_t)self*this->l, 1, self, c, sink, stats);
+			return;
+		}
+
+		int n = this->l*this->probes;
+		HashType stackBuffer[MaxStackHashes];
+		std::vector<HashType> heapBuffer;
+		HashType *g = stackBuffer;
+		if (n > MaxStackHashes) {
+			heapBuffer.resize(n);
+			g = heapBuffer.data();
+		}
+		if (this->probes > 1) {
+			this->hasher->HashProbes(p, this->probes, g);
+		} else {
+			this->hasher->Hash(p, g);
+		}
+
+		this->scan(p, g, this->probes, self, c, sink, stats);
+	}
+
+	// Returns the ids in table i that are hashed to h, and stores their number in n.
+	inline const PointID *lookup(size_t i, HashType h, size_t *n) const {
+		if (this->frozen != nullptr) {
+			return this->frozen[i].Find(h, n);
+		}
+
+		auto bucket = this->bins[i].find(h);
+		if (bucket == this->bins[i].end()) {
+			*n = 0;
+			return nullptr;
+		}
+		*n = bucket->second.size();
+		return bucket->second.data();
+	}
+
+	// The query contexts of a thread, one per level of nested queries: a
+	// query made from the callback of QueryRange must not reset the context
+	// of the query that called it.
+	struct contextStack {
+		std::vector<std::unique_ptr<QueryContext> > contexts;
+		size_t depth;
+
+		contextStack() : depth(0) {
+		}
+	};
+
+	// Holds the query context of the calling thread for the current level of
+	// nested queries, reset for a new query, until it goes out of scope.
+	// Reusing contexts saves allocating a visited array for every query.
+	class contextHold {
+		contextStack &s;
+
+		contextHold(const contextHold&) = delete;
+		contextHold &operator=(const contextHold&) = delete;
+
+		static contextStack &stack() {
+			static thread_local contextStack s;
+			return s;
+		}
+
+		static QueryContext &acquire(contextStack &s) {
+			if (s.depth == s.contexts.size()) {
+				s.contexts.emplace_back(new QueryContext());
+			}
+			return *s.contexts[s.depth++];
+		}
+
+	public:
+		QueryContext &c;
+
+		contextHold(int limit, size_t nPoints) : s(stack()), c(acquire(this->s)) {
+			this->c.Reset(limit, nPoints);
+		}
+
+		~contextHold() {
+			this->s.depth--;
+		}
+	};
+
+	// The ids of a bucket found by a query, and their number.
+	struct span {
+		const PointID *ids;
+		size_t n;
+	};
+
+	// Scratch space of QueryBatch, kept across groups of queries.
+	struct batchScratch {
+		std::vector<HashType> keys;
+		std::vector<HashType> sub;
+		std::vector<span> spans;
+	};
+
+	// Scans the buckets the hashes g of p fall into, passing the candidates
+	// to sink. g holds probes hashes per table. Every point is scored once,
+	// even if it is in several of the buckets. Skips the point self.
+	template <class Sink>
+	void scan(const FeatureVector &p, const HashType *g, int probes, PointID self, QueryContext &c, const Sink &sink, QueryStats *stats) const {
+		size_t buckets = (size_t)this->l*probes;
+		span stackSpans[MaxStackHashes];
+		std::vector<span> heapSpans;
+		span *spans = stackSpans;
+		if (buckets > MaxStackHashes) {
+			heapSpans.resize(buckets);
+			spans = heapSpans.data();
+		}
+		HashType stackSub[MaxStackHashes];
+		std::vector<HashType> heapSub;
+		HashType *sub = stackSub;
+		bool hashed = false;
+		if (this->splitDepth > 0 && this->l*this->splitDepth > MaxStackHashes) {
+			heapSub.resize(this->l*this->splitDepth);
+			sub = heapSub.data();
+		}
+
+		for (size_t h = 0; h < buckets; h++) {
+			size_t i = h / probes;
+			HashType key = g[h];
+			if (this->splitDepth > 0 && this->frozen != nullptr) {
+				key = this->leaf(i, key, p, sub, &hashed);
+			}
+			spans[h].ids = this->lookup(i, key, &spans[h].n);
+		}
+		this->collect(p, spans, buckets, self, c, sink, stats);
+	}
+
+	// Scores the ids in the given buckets against p and passes them to sink.
+	// c marks the points visited, so that every point is scored once, even
+	// if it is in several of the buckets. Skips the point self.
+	//
+	// New candidates are gathered into blocks of ScanBlock ids which are
+	// scored at once by FeatureVector::SimilarityBatch. Their points and
+	// norms are prefetched as they join the block.
+	//
+	// The counters are kept in locals and added to stats, if not nullptr, at the end.
+	template <class Sink>
+	void collect(const FeatureVector &p, const span *spans, size_t buckets, PointID self, QueryContext &c, const Sink &sink, QueryStats *stats) const {
+		PointID candidates[ScanBlock];
+		float similarities[ScanBlock];
+		size_t n = 0;
+		float norm = p.Norm();
+		size_t scanned = 0, duplicates = 0, evaluations = 0;
+
+		for (size_t h = 0; h < buckets; h++) {
+			const PointID *v = spans[h].ids;
+			size_t vSize = spans[h].n;
+			scanned += vSize;
 
 			for (size_t j = 0; j < vSize; j++) {
-				auto &q = *v[j];
-				c.Insert(q, p.Similarity(q), q.NCopies());
+				PointID id = v[j];
+				if (id == self) {
+					continue;
+				}
+				if (!c.Visit(id)) {
+					duplicates++;
+					continue;
+				}
+				__builtin_prefetch(this->points + id);
+				__builtin_prefetch(this->norms + id);
+				candidates[n++] = id;
+				if (n == ScanBlock) {
+					this->score(p, norm, candidates, n, similarities, sink);
+					evaluations += n;
+					n = 0;
+				}
 			}
 		}
+		if (n > 0) {
+			this->score(p, norm, candidates, n, similarities, sink);
+			evaluations += n;
+		}
 
-		c.shrink();
-		return c.Neighbors();
+		if (stats != nullptr) {
+			stats->buckets += buckets;
+			stats->candidates += scanned;
+			stats->duplicates += duplicates;
+			stats->evaluations += evaluations;
+			stats->replacements += c.Replacements();
+		}
 	}
 
- private:
+	// Answers the m queries qs into results, moving them through each stage
+	// together: hashing, following splits, two rounds of prefetching the
+	// frozen tables, bucket lookup while prefetching the ids, and scoring.
+	void queryGroup(const FeatureVector *qs, size_t m, int limit, std::vector<Neighbor> *results, batchScratch &s, QueryStats *stats) const {
+		size_t per = (size_t)this->l*this->probes, total = m*per;
+		s.keys.resize(total);
+		s.spans.resize(total);
+		HashType *g = s.keys.data();
+		if (this->probes > 1) {
+			for (size_t j = 0; j < m; j++) {
+				this->hasher->HashProbes(qs[j], this->probes, g + j*per);
+			}
+		} else {
+			this->hasher->HashBatch(qs, m, g);
+		}
+
+		if (this->splitDepth > 0 && this->frozen != nullptr) {
+			s.sub.resize(this->l*this->splitDepth);
+			for (size_t j = 0; j < m; j++) {
+				bool hashed = false;
+				for (size_t h = 0; h < per; h++) {
+					g[j*per + h] = this->leaf(h / this->probes, g[j*per + h], qs[j], s.sub.data(), &hashed);
+				}
+			}
+		}
+
+		if (this->frozen != nullptr) {
+			for (size_t h = 0; h < total; h++) {
+				this->frozen[(h % per) / this->probes].PrefetchSlot(g[h]);
+			}
+			for (size_t h = 0; h < total; h++) {
+				this->frozen[(h % per) / this->probes].PrefetchKeys(g[h]);
+			}
+		}
+		for (size_t h = 0; h < total; h++) {
+			span &b = s.spans[h];
+			b.ids = this->lookup((h % per) / this->probes, g[h], &b.n);
+			if (b.n > 0) {
+				__builtin_prefetch(b.ids);
+			}
+		}
+
+		// One context for the group, and the neighbors copied into results in
+		// place, so that reused results allocate nothing.
+		contextHold hold(limit, this->nPoints);
+		QueryContext &c = hold.c;
+		for (size_t j = 0; j < m; j++) {
+			if (j > 0) {
+				c.Reset(limit, this->nPoints);
+			}
+			this->collect(qs[j], s.spans.data() + j*per, per, MaxPointID, c, topSink{this, c}, stats);
+			results[j].resize(c.Size());
+			c.CopyNeighbors(results[j].data());
+		}
+	}
+
+	// Scores the n candidates against p, whose norm is given, and passes
+	// them along with their similarities to sink.
+	template <class Sink>
+	inline void score(const FeatureVector &p, float norm, const PointID *candidates, size_t n, float *similarities, const Sink &sink) const {
+		FeatureVector::SimilarityBatch(p, norm, this->points, this->norms, candidates, n, similarities);
+		sink(candidates, similarities, n);
+	}
+
+	// Sink of score keeping the most similar candidates in c.
+	struct topSink {
+		const LSH *lsh;
+		QueryContext &c;
+
+		inline void operator()(const PointID *ids, const float *similarities, size_t n) const {
+			for (size_t j = 0; j < n; j++) {
+				this->c.Insert(ids[j], similarities[j], this->lsh->points[ids[j]].NCopies());
+			}
+		}
+	};
+
+	// Sink of score passing the candidates at least threshold similar to f,
+	// and counting them in found.
+	template <class F>
+	struct rangeSink {
+		const F &f;
+		float threshold;
+		size_t *found;
+
+		inline void operator()(const PointID *ids, const float *similarities, size_t n) const {
+			for (size_t j = 0; j < n; j++) {
+				if (similarities[j] >= this->threshold) {
+					this->f(ids[j], similarities[j]);
+					(*this->found)++;
+				}
+			}
+		}
+	};
+
+	// A bucket of table i with at least two ids, for SelfJoin.
+	struct joinTask {
+		size_t i;
+		const PointID *ids;
+		size_t n;
+	};
+
+	// A pair found by SelfJoin, a < b.
+	struct joinPair {
+		PointID a;
+		PointID b;
+		float similarity;
+	};
+
+	// Appends to pairs the pairs of the bucket t at least threshold similar,
+	// leaving out those that share a bucket in an earlier table according to
+	// keys, the bucket of point id in table i being keys[id*l + i].
+	void joinBucket(const joinTask &t, const HashType *keys, float threshold, std::vector<joinPair> &pairs, QueryStats *stats) const {
+		PointID candidates[ScanBlock];
+		float similarities[ScanBlock];
+		size_t l = this->l;
+		size_t duplicates = 0, evaluations = 0;
+
+		for (size_t x = 0; x + 1 < t.n; x++) {
+			PointID a = t.ids[x];
+			const HashType *ka = keys + (size_t)a*l;
+			size_t m = 0;
+			for (size_t y = x + 1; y < t.n; y++) {
+				PointID b = t.ids[y];
+				const HashType *kb = keys + (size_t)b*l;
+				bool earlier = false;
+				for (size_t i = 0; i < t.i && !earlier; i++) {
+					earlier = ka[i] == kb[i];
+				}
+				if (earlier) {
+					duplicates++;
+					continue;
+				}
+				candidates[m++] = b;
+				if (m == ScanBlock) {
+					this->joinScore(a, candidates, m, threshold, similarities, pairs);
+					evaluations += m;
+					m = 0;
+				}
+			}
+			if (m > 0) {
+				this->joinScore(a, candidates, m, threshold, similarities, pairs);
+				evaluations += m;
+			}
+		}
+
+		stats->buckets++;
+		stats->candidates += t.n*(t.n - 1)/2;
+		stats->duplicates += duplicates;
+		stats->evaluations += evaluations;
+	}
+
+	// Scores the n candidates against point a and appends those at least
+	// threshold similar to pairs, using n floats of scratch space.
+	inline void joinScore(PointID a, const PointID *candidates, size_t n, float threshold, float *similarities, std::vector<joinPair> &pairs) const {
+		FeatureVector::SimilarityBatch(this->points[a], this->norms[a], this->points, this->norms, candidates, n, similarities);
+		for (size_t j = 0; j < n; j++) {
+			if (similarities[j] >= threshold) {
+				PointID b = candidates[j];
+				pairs.push_back(joinPair{a < b ? a : b, a < b ? b : a, similarities[j]});
+			}
+		}
+	}
+
+	// Number of pairs a thread of SelfJoin collects before handing them to f.
+	static const size_t JoinBlock = 4096;
+
+	// Number of candidates scored together by collect.
+	static const size_t ScanBlock = 256;
+
+	// Number of queries QueryBatch moves through its stages together, unless
+	// set by SetBatchGroup. On 8M 64-bit codes in BitSampling tables several
+	// times the size of the last level cache (BenchmarkQueryBatch in
+	// lsh_test.cc), groups of 4 to 128 are within noise of each other, 1.2x
+	// to 1.5x faster than Query from run to run, and 1 only 1.1x to 1.2x.
+	// That is well short of hiding every miss: scoring still waits on the
+	// points of each query, and also prefetching them for the whole group
+	// made it slower. 16 sits in the middle of the flat range.
+	static const size_t BatchGroup = 16;
+
 	int d;  // the dimension of the feature space.
 	int k;  // number of elementary hash functions (h) to be concataneted to obtain a reliable enough hash function (g). LSH queries becomes more selective with increasing k, due to the reduced the probability of collision.
 	int l;  // number of "copies" of the bins (with a different random matrices). Increasing L will increase the number of points the should be scanned linearly during query.
+	int threads;  // number of threads used by Insert.
+	int probes;  // number of buckets visited per table by Query.
+	size_t batchGroup;  // number of queries QueryBatch moves through its stages together.
 	Hasher *hasher;
-	bin<FeatureVector> *bins;  // bins[bin][hash] gives the FeatureVector that is hashed to hash in the bin bins[bin].
-	hashCache<FeatureVector> cache;
+	bin *bins;  // bins[bin][hash] gives the ids of the points that are hashed to hash in the bin bins[bin].
+	bool ownsHasher;  // set for indexes returned by Open.
+	Hasher *splitter;  // hashes splitting overloaded buckets, table i at level j being splitter table i*splitDepth + j; owned.
+	size_t splitThreshold;  // largest bucket Freeze leaves whole.
+	int splitDepth;  // levels of splits; 0 if buckets are not split.
+	int splitK;  // elementary hashes per level of splits.
+	frozenBin *frozen;  // replaces bins after Freeze, nullptr before.
+	const FeatureVector *points;  // points[id] is the point with the given id.
+	const HashType *hashes;  // hashes[id*l + i] is the hash of point id in bins[i].
+	const float *norms;  // norms[id] is points[id].Norm().
+	size_t nPoints;
+	std::vector<FeatureVector> pointStore;  // backs points, unless mapped from a file.
+	std::vector<HashType> hashStore;  // backs hashes, unless mapped from a file.
+	std::vector<float> normStore;  // backs norms, unless mapped from a file.
+	MappedFile *file;  // the index file backing an index returned by Open.
 };
 
 };
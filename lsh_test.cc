@@ -19,7 +19,19 @@
 #include <sys/time.h>
 #include "lsh.h"
 #include "slsh.h"
+#include "fastslsh.h"
 #include "bitvector64.h"
+#include "bitvector.h"
+#include "densevector.h"
+#include "tuner.h"
+#include "concurrentlsh.h"
+#include "quantizedslsh.h"
+#include "tableslsh.h"
+#include "simhash.h"
+#include "bitsampling.h"
+#include "ingest.h"
+#include <atomic>
+#include <thread>
 
 #define SEED time(0)
 
@@ -33,6 +45,25 @@ slash::SLSH<BitVector64> *slsh;
 slash::LSH<BitVector64, slash::SLSH<BitVector64> > *lsh;
 char buf[256];
 std::vector<BitVector64> points;
+int failures = 0;
+
+// Returns true if the similarities a and b are equal up to the rounding
+// that -ffast-math lets the compiler choose differently in scalar and batch
+// code, or both NaN.
+bool sameSimilarity(float a, float b) {
+	if (a != a || b != b) {
+		return a != a && b != b;
+	}
+	return fabsf(a - b) <= 1e-6f*std::max(1.0f, fabsf(b));
+}
+
+// Prints a failure and makes main return nonzero unless ok.
+void check(bool ok, const char *what) {
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
 
 void init() {
 	srandom(SEED);
@@ -52,23 +83,84 @@ void TestLinearSearch() {
 	BitVector64 &p = points[0];
 	timespec start, end;
 	double del;
-	slash::QueryContext<BitVector64> c(limit+1);
+	slash::QueryContext c(limit);
 
 	clock_gettime(CLOCK_MONOTONIC, &start);
-	for (size_t i = 0; i < NPOINTS; i++) {
+	for (size_t i = 1; i < NPOINTS; i++) {
 			BitVector64 &q = points[i];
-			c.Insert(q, p.Similarity(q), q.NCopies());
+			c.Insert((slash::PointID)i, p.Similarity(q), q.NCopies());
 	}
 	clock_gettime(CLOCK_MONOTONIC, &end);
 	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
 	printf("%g ns/op\n", del);
 	
-	c.shrink();
 	auto neighbors = c.Neighbors();
 
 	for(size_t i=0; i<neighbors.size(); i++) {
-		printf("n%d: %g, %s\n", (int)i, p.Similarity(neighbors[i]), neighbors[i].String(buf));
+		printf("n%d: %g, %s\n", (int)i, neighbors[i].similarity, points[neighbors[i].id].String(buf));
+	}
+
+	size_t n = points.size();
+	std::vector<slash::PointID> ids(n);
+	std::vector<float> norms(n), similarities(n);
+	for (size_t i = 0; i < n; i++) {
+		ids[i] = (slash::PointID)i;
+		norms[i] = points[i].Norm();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	BitVector64::SimilarityBatch(p, p.Norm(), points.data(), norms.data(), ids.data(), n, similarities.data());
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("SimilarityBatch: %g ns/op\n", del);
+
+	size_t mismatches = 0, inexact = 0;
+	for (size_t i = 0; i < n; i++) {
+		float s = p.Similarity(points[i]);
+		inexact += similarities[i] != s && !(s != s && similarities[i] != similarities[i]);
+		mismatches += !sameSimilarity(similarities[i], s);
 	}
+	printf("mismatching similarities: %llu (%llu not bit for bit)\n", (unsigned long long)mismatches, (unsigned long long)inexact);
+	check(mismatches == 0, "SimilarityBatch against Similarity");
+}
+
+void TestHashBatch() {
+	printf("==== %s\n", __func__);
+
+	timespec start, end;
+	double del;
+	size_t n = points.size();
+	std::vector<slash::HashType> g(n*L), gBatch(n*L);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < n; i++) {
+		slsh->Hash(points[i], &g[i*L]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("Hash: %g ns/op\n", del/n);
+
+	double delHash = del;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	slsh->HashBatch(points.data(), n, gBatch.data());
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("HashBatch: %g ns/op (speedup %gx)\n", del/n, delHash/del);
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < n*L; i++) {
+		if (g[i] != gBatch[i]) {
+			mismatches++;
+		}
+	}
+	printf("mismatching hashes: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "HashBatch against Hash");
+
+	mismatches = 0;
+	for (size_t i = 0; i < n*L; i++) {
+		mismatches += slsh->HashTable(points[i/L], (int)(i%L)) != g[i];
+	}
+	check(mismatches == 0, "HashTable against Hash");
 }
 
 void TestInsert() {
@@ -86,19 +178,1313 @@ void TestInsert() {
 	printf("%g ns/op\n", del);
 }
 
+void TestParallelInsert() {
+	printf("==== %s\n", __func__);
+
+	timespec start, end;
+	double del, delSerial;
+	// A fixed count, so that the parallel path runs on a single core too.
+	const int threads = 4;
+	slash::LSH<BitVector64, slash::SLSH<BitVector64> > serial(d, k, L, slsh), parallel(d, k, L, slsh);
+	parallel.SetThreads(threads);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	serial.Insert(points);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	delSerial = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	parallel.Insert(points);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+
+	printf("1 thread: %g ns/op\n", delSerial/NPOINTS);
+	printf("%d threads: %g ns/op (speedup %gx)\n", threads, del/NPOINTS, delSerial/del);
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < points.size(); i++) {
+		if (serial.Query((slash::PointID)i, limit) != parallel.Query((slash::PointID)i, limit)) {
+			mismatches++;
+		}
+	}
+	printf("queries with different results: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "parallel Insert against serial Insert");
+}
+
+// Damages copies of the index file at path, written by Save from nPoints
+// BitVector64 points without splits, and checks that Open rejects them.
+void TestCorruptIndex(const char *path, size_t nPoints) {
+	printf("==== %s\n", __func__);
+	typedef slash::LSH<BitVector64, slash::SLSH<BitVector64> > Index;
+
+	FILE *f = fopen(path, "rb");
+	std::vector<char> file;
+	if (f != nullptr) {
+		fseek(f, 0, SEEK_END);
+		file.resize(ftell(f));
+		fseek(f, 0, SEEK_SET);
+		file.resize(fread(file.data(), 1, file.size(), f));
+		fclose(f);
+	}
+
+	// Offsets in the file header and in the first bin, see LSH::Save and
+	// frozenBin::Write.
+	auto at = [&](size_t offset) -> char* { return file.data() + offset; };
+	uint64_t hasherBytes, splitterBytes, nKeys, nIDs;
+	memcpy(&hasherBytes, at(40), 8);
+	memcpy(&splitterBytes, at(64), 8);
+	size_t bin = 128 + slash::alignedSize(hasherBytes) + slash::alignedSize(splitterBytes) +
+		slash::alignedSize(nPoints*sizeof(BitVector64)) + slash::alignedSize(nPoints*L*sizeof(slash::HashType)) +
+		slash::alignedSize(nPoints*sizeof(float));
+	memcpy(&nKeys, at(bin), 8);
+	memcpy(&nIDs, at(bin + 8), 8);
+	size_t offsets = bin + 64 + slash::alignedSize(nKeys*sizeof(slash::HashType));
+	size_t ids = offsets + slash::alignedSize((nKeys + 1)*sizeof(uint32_t));
+	size_t directory = ids + slash::alignedSize(nIDs*sizeof(slash::PointID));
+
+	const char *damaged = "lsh_test_damaged.idx";
+	size_t accepted = 0;
+	auto expectRejected = [&](const char *what, size_t offset, const void *value, size_t n) {
+		std::vector<char> copy(file);
+		memcpy(copy.data() + offset, value, n);
+		FILE *out = fopen(damaged, "wb");
+		fwrite(copy.data(), 1, copy.size(), out);
+		fclose(out);
+		Index *index = Index::Open(damaged);
+		if (index != nullptr) {
+			printf("accepted: %s\n", what);
+			accepted++;
+			delete index;
+		}
+	};
+
+	uint32_t u32;
+	uint64_t u64;
+	memcpy(&u32, at(16), 4); u32++;
+	expectRejected("d other than the hasher's", 16, &u32, 4);
+	memcpy(&u32, at(20), 4); u32--;
+	expectRejected("k other than the hasher's", 20, &u32, 4);
+	memcpy(&u32, at(24), 4); u32++;
+	expectRejected("L other than the hasher's", 24, &u32, 4);
+	u64 = ~(uint64_t)0;
+	expectRejected("hasherBytes overflowing", 40, &u64, 8);
+	u32 = 0x24924925;  // times the 7 bits of a vertex wraps around to 3.
+	expectRejected("SLSH k*hbits overflowing 32 bits", 128 + 8, &u32, 4);
+	u32 = ~(uint32_t)0;
+	expectRejected("decreasing offsets", offsets + 4, &u32, 4);
+	u32 = (uint32_t)nPoints;
+	expectRejected("id out of range", ids, &u32, 4);
+	u32 = (uint32_t)nKeys + 1;
+	expectRejected("directory past the keys", directory + 4, &u32, 4);
+	u64 = (uint64_t)1 << 62;
+	expectRejected("nDirectory overflowing", bin + 16, &u64, 8);
+
+	Index *index = Index::Open(path);
+	printf("damaged files accepted: %llu\n", (unsigned long long)accepted);
+	check(!file.empty() && index != nullptr && accepted == 0, "Open rejects damaged index files");
+	delete index;
+	remove(damaged);
+}
+
+void TestFreeze() {
+	printf("==== %s\n", __func__);
+
+	timespec start, end;
+	double del;
+	slash::LSH<BitVector64, slash::SLSH<BitVector64> > frozen(d, k, L, slsh);
+	frozen.Insert(points);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	frozen.Freeze();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("%g ns/op\n", del/NPOINTS);
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < points.size(); i++) {
+		if (lsh->Query((slash::PointID)i, limit) != frozen.Query((slash::PointID)i, limit)) {
+			mismatches++;
+		}
+	}
+	printf("queries with different results: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "frozen queries against live ones");
+
+	printf("==== %s\n", "TestSaveOpen");
+	const char *path = "lsh_test.idx";
+	if (!frozen.Save(path)) {
+		check(false, "Save");
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	auto mapped = slash::LSH<BitVector64, slash::SLSH<BitVector64> >::Open(path);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	if (mapped == nullptr) {
+		check(false, "Open");
+		remove(path);
+		return;
+	}
+	printf("Open: %g ns\n", del);
+
+	mismatches = 0;
+	for (size_t i = 0; i < points.size(); i++) {
+		if (frozen.Query((slash::PointID)i, limit) != mapped->Query((slash::PointID)i, limit) ||
+			frozen.Query(points[i], limit) != mapped->Query(points[i], limit)) {
+			mismatches++;
+		}
+	}
+	printf("queries with different results: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "opened queries against saved ones");
+
+	delete mapped;
+	TestCorruptIndex(path, points.size());
+	remove(path);
+}
+
 void TestQuery() {
 	printf("==== %s\n", __func__);
 	
 	BitVector64 &p = points[0];
-	size_t linearSearchSize = 0;
+	slash::QueryStats stats;
+
+	printf("p: %s\n", p.String(buf));
+
+	auto neighbors = lsh->Query(0, limit, &stats);
+	printf("SLSH\nd=%d, k=%d, L=%d, #points=%llu, linearSearch=%g\n", d, k, L, (unsigned long long)NPOINTS, (double)stats.candidates);
+	check(lsh->Query(0, limit, nullptr) == neighbors, "Query without stats");
+	for(size_t i=0; i<neighbors.size(); i++) {
+		printf("n%d: %g, %s\n", (int)i, neighbors[i].similarity, points[neighbors[i].id].String(buf));
+	}
+}
+
+void TestQueryNew() {
+	printf("==== %s\n", __func__);
+
+	BitVector64 p((uint64_t)random());
+	slash::QueryStats stats;
 
 	printf("p: %s\n", p.String(buf));
 
-	auto neighbors = lsh->Query(p, limit, &linearSearchSize);
-	printf("SLSH\nd=%d, k=%d, L=%d, #points=%llu, linearSearch=%g\n", d, k, L, (unsigned long long)NPOINTS, (double)linearSearchSize);
+	auto neighbors = lsh->Query(p, limit, &stats);
+	printf("linearSearch=%g\n", (double)stats.candidates);
+	std::vector<slash::HashType> g(L);
+	slsh->Hash(p, g.data());
+	check(lsh->Query(p, g.data(), limit) == neighbors, "Query of a new point against Query with its hashes");
 	for(size_t i=0; i<neighbors.size(); i++) {
-		printf("n%d: %g, %s\n", (int)i, p.Similarity(neighbors[i]), neighbors[i].String(buf));
+		printf("n%d: %g, %s\n", (int)i, neighbors[i].similarity, points[neighbors[i].id].String(buf));
+	}
+}
+
+// Returns the fraction of the true top limit neighbors of p among vs, other
+// than vs[self], that are matched by neighbors, counting a neighbor as matched
+// if it is at least as similar as the limit-th most similar point.
+template <class Vector>
+double Recall(const std::vector<Vector> &vs, const Vector &p, size_t self, const std::vector<slash::Neighbor> &neighbors) {
+	slash::QueryContext c(limit);
+	for (size_t i = 0; i < vs.size(); i++) {
+		if (i != self) {
+			c.Insert((slash::PointID)i, p.Similarity(vs[i]), 1);
+		}
+	}
+	auto truth = c.Neighbors();
+	float kth = truth.back().similarity;
+
+	size_t matched = 0;
+	for (size_t i = 0; i < neighbors.size(); i++) {
+		if (neighbors[i].similarity >= kth) {
+			matched++;
+		}
+	}
+	return (double)matched/(double)truth.size();
+}
+
+template <class Vector>
+double Recall(const std::vector<Vector> &vs, size_t id, const std::vector<slash::Neighbor> &neighbors) {
+	return Recall(vs, vs[id], id, neighbors);
+}
+
+void TestMultiProbe() {
+	printf("==== %s\n", __func__);
+
+	const size_t nQueries = 200;
+	int probes[] = {1, 4, 16, 64};
+	slash::SLSH<BitVector64> hasher(d, k, 1);
+	slash::LSH<BitVector64, slash::SLSH<BitVector64> > single(d, k, 1, &hasher);
+	single.Insert(points);
+
+	// More probes visit a superset of the buckets, so no query may see fewer
+	// candidates or lose recall.
+	std::vector<size_t> lastCandidates(nQueries, 0);
+	std::vector<double> lastRecall(nQueries, 0);
+	size_t worse = 0;
+	for (int t = -1; t < (int)(sizeof(probes)/sizeof(probes[0])); t++) {
+		auto index = t < 0 ? lsh : &single;
+		int nProbes = t < 0 ? 1 : probes[t];
+		index->SetProbes(nProbes);
+
+		double recall = 0, linearSearch = 0;
+		for (size_t i = 0; i < nQueries; i++) {
+			slash::QueryStats stats;
+			auto neighbors = index->Query((slash::PointID)i, limit, &stats);
+			double r = Recall(points, i, neighbors);
+			recall += r;
+			linearSearch += (double)stats.candidates;
+			if (t >= 0) {
+				worse += stats.candidates < lastCandidates[i] || r < lastRecall[i];
+				lastCandidates[i] = stats.candidates;
+				lastRecall[i] = r;
+			}
+		}
+		printf("L=%d, probes=%d: recall@%d=%g, linearSearch=%g\n", t < 0 ? L : 1, nProbes, limit, recall/nQueries, linearSearch/nQueries);
 	}
+	printf("queries worse with more probes: %llu\n", (unsigned long long)worse);
+	check(worse == 0, "multi-probe queries against fewer probes");
+}
+
+// Checks BitVector<N> against the index with N-dimensional codes.
+template <int N>
+void TestBitVector() {
+	printf("==== %s<%d>\n", __func__, N);
+
+	typedef BitVector<N> Vector;
+	const size_t nPoints = 10000;
+	timespec start, end;
+	double del;
+	std::vector<Vector> vs(nPoints);
+	for (size_t i = 0; i < nPoints; i++) {
+		for (int b = 0; b < N; b++) {
+			if (random() & 1) {
+				vs[i].Set(b);
+			}
+		}
+	}
+
+	slash::SLSH<Vector> hasher(N, 2, L);
+	slash::LSH<Vector, slash::SLSH<Vector> > index(N, 2, L, &hasher);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	index.Insert(vs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("Insert: %g ns/op\n", del/nPoints);
+
+	size_t mismatches = 0, found = 0;
+	for (size_t i = 0; i < nPoints; i++) {
+		auto neighbors = index.Query((slash::PointID)i, limit);
+		found += neighbors.size();
+		for (size_t j = 0; j < neighbors.size(); j++) {
+			if (!sameSimilarity(neighbors[j].similarity, vs[i].Similarity(vs[neighbors[j].id]))) {
+				mismatches++;
+			}
+		}
+	}
+	printf("average # of neighbors: %g\n", (double)found/nPoints);
+	printf("mismatching similarities: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "BitVector similarities of Query against Similarity");
+}
+
+// Returns nPoints clustered D-dimensional embeddings: point i is a noisy
+// copy of random center i % nCenters.
+template <int D>
+std::vector<DenseVector<D> > ClusteredPoints(size_t nPoints, size_t nCenters) {
+	std::default_random_engine generator(random());
+	std::normal_distribution<float> normal(0.0f, 1.0f);
+	std::vector<float> centers(nCenters*D), x(D);
+	for (size_t i = 0; i < centers.size(); i++) {
+		centers[i] = normal(generator);
+	}
+	std::vector<DenseVector<D> > vs;
+	for (size_t i = 0; i < nPoints; i++) {
+		const float *c = &centers[(i % nCenters)*D];
+		for (int j = 0; j < D; j++) {
+			x[j] = c[j] + 0.3f*normal(generator);
+		}
+		vs.push_back(DenseVector<D>(x.data()));
+	}
+	return vs;
+}
+
+// Checks DenseVector<D> against the index with clustered embeddings.
+template <int D>
+void TestDenseVector() {
+	printf("==== %s<%d>\n", __func__, D);
+
+	typedef DenseVector<D> Vector;
+	const size_t nPoints = 20000, nCenters = 1000;
+	timespec start, end;
+	double del;
+	std::vector<Vector> vs = ClusteredPoints<D>(nPoints, nCenters);
+
+	slash::SLSH<Vector> hasher(D, 2, L);
+	slash::LSH<Vector, slash::SLSH<Vector> > index(D, 2, L, &hasher);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	index.Insert(vs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("Insert: %g ns/op\n", del/nPoints);
+
+	size_t mismatches = 0, found = 0, sameCenter = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < nPoints; i++) {
+		auto neighbors = index.Query((slash::PointID)i, limit);
+		found += neighbors.size();
+		for (size_t j = 0; j < neighbors.size(); j++) {
+			if (!sameSimilarity(neighbors[j].similarity, vs[i].Similarity(vs[neighbors[j].id]))) {
+				mismatches++;
+			}
+			if (neighbors[j].id % nCenters == i % nCenters) {
+				sameCenter++;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("Query: %g ns/op\n", del/nPoints);
+	printf("average # of neighbors: %g (%g from the same cluster)\n", (double)found/nPoints, (double)sameCenter/nPoints);
+	printf("mismatching similarities: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "DenseVector similarities of Query against Similarity");
+}
+
+// Indexes vs with hasher and prints the hashing time, the size of the
+// rotations and the recall of a few queries with 1 and 4 probes.
+template <class Vector, class Hasher>
+void CompareHasher(const char *name, const std::vector<Vector> &vs, int k, Hasher *hasher, size_t bytes) {
+	const size_t nQueries = 200;
+	timespec start, end;
+	slash::LSH<Vector, Hasher> index(Vector::Padded, k, L, hasher);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	index.Insert(vs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	printf("%s: Insert %g ns/op, rotations %g MB\n", name, del/vs.size(), (double)bytes/(1<<20));
+
+	for (int probes = 1; probes <= 4; probes *= 4) {
+		index.SetProbes(probes);
+		double recall = 0, linearSearch = 0;
+		for (size_t i = 0; i < nQueries; i++) {
+			slash::QueryStats stats;
+			auto neighbors = index.Query((slash::PointID)i, limit, &stats);
+			recall += Recall(vs, i, neighbors);
+			linearSearch += (double)stats.candidates;
+		}
+		printf("%s: probes=%d: recall@%d=%g, linearSearch=%g\n", name, probes, limit, recall/nQueries, linearSearch/nQueries);
+	}
+}
+
+// Draws the rotations of an SLSH from a seed with one and with several
+// threads, checks that they are the same and orthonormal, and times them.
+void TestRotations() {
+	printf("==== %s\n", __func__);
+
+	const int D = 256, rk = 4, rl = 8;
+	const uint64_t seed = 42;
+	timespec start, end;
+	double del[2];
+	slash::SLSH<BitVector64> *hashers[2];
+	for (int t = 0; t < 2; t++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		hashers[t] = new slash::SLSH<BitVector64>(D, rk, rl, seed, t == 0 ? 1 : 4);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		del[t] = (double)(end.tv_sec-start.tv_sec)+1e-9*(double)(end.tv_nsec-start.tv_nsec);
+	}
+
+	size_t mismatches = 0;
+	double worst = 0;
+	for (int m = 0; m < rk*rl; m++) {
+		for (int i = 0; i < D; i++) {
+			const float *a = hashers[0]->Row(m, i);
+			mismatches += memcmp(a, hashers[1]->Row(m, i), D*sizeof(float)) != 0;
+			for (int j = 0; m == 0 && j <= i; j++) {
+				const float *b = hashers[0]->Row(m, j);
+				double dot = 0;
+				for (int t = 0; t < D; t++) {
+					dot += (double)a[t]*b[t];
+				}
+				worst = std::max(worst, fabs(dot - (i == j ? 1 : 0)));
+			}
+		}
+	}
+	printf("%d rotations of %dx%d: %gs with 1 thread, %gs with 4\n", rk*rl, D, D, del[0], del[1]);
+	printf("rows different across thread counts: %llu, largest |R R^T - I|: %g\n", (unsigned long long)mismatches, worst);
+	check(mismatches == 0 && worst < 1e-4, "rotations across thread counts");
+	delete hashers[0];
+	delete hashers[1];
+}
+
+// Compares exact rotations (SLSH) with pseudo-random ones (FastSLSH) on
+// clustered D-dimensional embeddings.
+template <int D>
+void TestFastSLSH() {
+	printf("==== %s<%d>\n", __func__, D);
+
+	typedef DenseVector<D> Vector;
+	const int fk = 2;
+	std::vector<Vector> vs = ClusteredPoints<D>(20000, 1000);
+
+	slash::FastSLSH<Vector> fast(D, fk, L);
+	std::vector<slash::HashType> batch(vs.size()*L), single(L);
+	fast.HashBatch(vs.data(), vs.size(), batch.data());
+	size_t mismatches = 0;
+	for (size_t i = 0; i < vs.size(); i++) {
+		fast.Hash(vs[i], single.data());
+		for (int t = 0; t < L; t++) {
+			if (single[t] != batch[i*L + t] || single[t] != fast.HashTable(vs[i], t)) {
+				mismatches++;
+			}
+		}
+	}
+	printf("hashes different from Hash: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "FastSLSH HashBatch and HashTable against Hash");
+
+	slash::SLSH<Vector> exact(D, fk, L);
+	CompareHasher("SLSH", vs, fk, &exact, exact.Bytes());
+	CompareHasher("FastSLSH", vs, fk, &fast, fast.Bytes());
+}
+
+// Hashes points with the quantized rotations of a QuantizedSLSH and with
+// the exact ones it keeps, and compares the hashes and the time taken. Then
+// checks that an index saved with it maps back to the same results.
+template <class Vector>
+void TestQuantized(const char *name, int d, const std::vector<Vector> &vs) {
+	printf("==== %s<%s>\n", __func__, name);
+
+	typedef slash::QuantizedSLSH<Vector> Hasher;
+	Hasher quantized(d, k, L, 1);
+	const slash::SLSH<Vector> &exact = quantized.Exact();
+	std::vector<slash::HashType> a(vs.size()*L), b(vs.size()*L);
+	timespec start, end;
+	double del[2];
+	for (int t = 0; t < 2; t++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < vs.size(); i++) {
+			if (t == 0) {
+				exact.Hash(vs[i], &a[i*L]);
+			} else {
+				quantized.Hash(vs[i], &b[i*L]);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		del[t] = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	}
+	size_t mismatches = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		mismatches += a[i] != b[i];
+	}
+	// HashBatch counts the rechecks, and must agree with Hash too.
+	uint64_t rechecks = 0, hashes = (uint64_t)vs.size()*quantized.K()*quantized.L();
+	quantized.HashBatch(vs.data(), vs.size(), b.data(), &rechecks);
+	for (size_t i = 0; i < a.size(); i++) {
+		mismatches += a[i] != b[i] || a[i] != quantized.HashTable(vs[i/L], (int)(i%L));
+	}
+	printf("exact: %g ns/op, %g KB; quantized: %g ns/op, %g KB, %g%% of elementary hashes rechecked\n",
+		del[0]/vs.size(), (double)exact.Bytes()/1024, del[1]/vs.size(), (double)quantized.Bytes()/1024, 100.0*rechecks/hashes);
+	printf("hashes different from SLSH: %llu of %llu\n", (unsigned long long)mismatches, (unsigned long long)(2*a.size()));
+	check(mismatches == 0, "QuantizedSLSH hashes against SLSH");
+
+	slash::LSH<Vector, Hasher> index(d, k, L, &quantized);
+	index.Insert(vs);
+	index.Freeze();
+	index.Save("lsh_test.idx");
+	auto mapped = slash::LSH<Vector, Hasher>::Open("lsh_test.idx");
+	mismatches = mapped == nullptr ? vs.size() : 0;
+	for (size_t i = 0; mapped != nullptr && i < 1000; i++) {
+		if (mapped->Query(vs[i], limit) != index.Query(vs[i], limit)) {
+			mismatches++;
+		}
+	}
+	printf("mapped queries with different results: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "opened queries against saved ones");
+	delete mapped;
+	remove("lsh_test.idx");
+}
+
+// Hashes binary points with the tables of a TableSLSH and with the exact
+// rotations it keeps, and compares the hashes and the time taken. Then
+// checks that an index saved with it maps back to the same results.
+template <class Vector>
+void TestTable(const char *name, int d, const std::vector<Vector> &vs) {
+	printf("==== %s<%s>\n", __func__, name);
+
+	typedef slash::TableSLSH<Vector> Hasher;
+	Hasher tables(d, k, L);
+	const slash::SLSH<Vector> &exact = tables.Exact();
+	std::vector<slash::HashType> a(vs.size()*L), b(vs.size()*L), c(vs.size()*L);
+	timespec start, end;
+	double del[2];
+	for (int t = 0; t < 2; t++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < vs.size(); i++) {
+			if (t == 0) {
+				exact.Hash(vs[i], &a[i*L]);
+			} else {
+				tables.Hash(vs[i], &b[i*L]);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		del[t] = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	}
+	tables.HashBatch(vs.data(), vs.size(), c.data());
+	size_t mismatches = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		mismatches += a[i] != b[i] || a[i] != c[i];
+	}
+	printf("exact: %g ns/op, %g KB; tables: %g ns/op, %g KB\n",
+		del[0]/vs.size(), (double)exact.Bytes()/1024, del[1]/vs.size(), (double)tables.Bytes()/1024);
+	printf("hashes different from SLSH: %llu of %llu\n", (unsigned long long)mismatches, (unsigned long long)a.size());
+	check(mismatches == 0, "TableSLSH hashes against SLSH");
+
+	slash::LSH<Vector, Hasher> index(d, k, L, &tables);
+	index.Insert(vs);
+	index.Freeze();
+	index.Save("lsh_test.idx");
+	auto mapped = slash::LSH<Vector, Hasher>::Open("lsh_test.idx");
+	mismatches = mapped == nullptr ? vs.size() : 0;
+	for (size_t i = 0; mapped != nullptr && i < 1000; i++) {
+		if (mapped->Query(vs[i], limit) != index.Query(vs[i], limit)) {
+			mismatches++;
+		}
+	}
+	printf("mapped queries with different results: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "opened queries against saved ones");
+	delete mapped;
+	remove("lsh_test.idx");
+}
+
+// Returns n random codes of N bits.
+template <int N>
+std::vector<BitVector<N> > RandomCodes(size_t n) {
+	std::vector<BitVector<N> > vs(n);
+	for (size_t i = 0; i < n; i++) {
+		for (int b = 0; b < N; b++) {
+			if (random() & 1) {
+				vs[i].Set(b);
+			}
+		}
+	}
+	return vs;
+}
+
+// Returns n 64-bit codes around nCenters random centers, each bit of a
+// code differing from its center with probability 1/8.
+std::vector<BitVector64> ClusteredCodes(size_t n, size_t nCenters) {
+	std::vector<uint64_t> centers(nCenters);
+	for (size_t c = 0; c < nCenters; c++) {
+		centers[c] = ((uint64_t)random() << 33) ^ ((uint64_t)random() << 11) ^ (uint64_t)random();
+	}
+	std::vector<BitVector64> vs;
+	for (size_t i = 0; i < n; i++) {
+		uint64_t v = centers[i % nCenters];
+		for (int b = 0; b < 64; b++) {
+			if (random() % 8 == 0) {
+				v ^= (uint64_t)1 << b;
+			}
+		}
+		vs.push_back(BitVector64(v));
+	}
+	return vs;
+}
+
+// Builds an index over vs with hasher, and prints the cost of hashing a
+// point against the recall of the index with 1 and 4 probes. Then checks
+// that the index saved with it maps back to the same results.
+template <class Vector, class Hasher>
+void CompareFamily(const char *name, const std::vector<Vector> &vs, int d, int fk, int fl, Hasher *hasher) {
+	const size_t nQueries = 200;
+	timespec start, end;
+	slash::LSH<Vector, Hasher> index(d, fk, fl, hasher);
+	std::vector<slash::HashType> g(vs.size()*fl);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hasher->HashBatch(vs.data(), vs.size(), g.data());
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	index.Insert(vs);
+
+	for (int probes = 1; probes <= 4; probes *= 4) {
+		index.SetProbes(probes);
+		double recall = 0, linearSearch = 0;
+		for (size_t i = 0; i < nQueries; i++) {
+			slash::QueryStats stats;
+			auto neighbors = index.Query((slash::PointID)i, limit, &stats);
+			recall += Recall(vs, i, neighbors);
+			linearSearch += (double)stats.candidates;
+		}
+		printf("%s k=%d L=%d: hash %g ns/op, probes=%d: recall@%d=%g, linearSearch=%g\n",
+			name, fk, fl, del/vs.size(), probes, limit, recall/nQueries, linearSearch/nQueries);
+	}
+
+	index.SetProbes(1);
+	index.Freeze();
+	index.Save("lsh_test.idx");
+	auto mapped = slash::LSH<Vector, Hasher>::Open("lsh_test.idx");
+	size_t mismatches = mapped == nullptr ? vs.size() : 0;
+	for (size_t i = 0; mapped != nullptr && i < nQueries; i++) {
+		if (mapped->Query(vs[i], limit) != index.Query(vs[i], limit)) {
+			mismatches++;
+		}
+	}
+	if (mismatches != 0) {
+		printf("%s: mapped queries with different results: %llu\n", name, (unsigned long long)mismatches);
+	}
+	check(mismatches == 0, "opened queries against saved ones");
+	delete mapped;
+	remove("lsh_test.idx");
+}
+
+// Compares SLSH with the one-bit hasher families, SimHash and BitSampling,
+// on clustered 64-bit codes, at about the same number of hash bits per table.
+void TestFamilies() {
+	printf("==== %s\n", __func__);
+
+	const int fl = 8;
+	std::vector<BitVector64> vs = ClusteredCodes(20000, 2000);
+	slash::SLSH<BitVector64> exact(64, 2, fl);
+	CompareFamily("SLSH", vs, 64, 2, fl, &exact);
+	slash::SimHash<BitVector64> simhash(64, 14, fl);
+	CompareFamily("SimHash", vs, 64, 14, fl, &simhash);
+	slash::SimHash<BitVector64> simhash2(64, 10, fl);
+	CompareFamily("SimHash", vs, 64, 10, fl, &simhash2);
+	slash::BitSampling<BitVector64> sampling(64, 14, fl);
+	CompareFamily("BitSampling", vs, 64, 14, fl, &sampling);
+	slash::BitSampling<BitVector64> sampling2(64, 10, fl);
+	CompareFamily("BitSampling", vs, 64, 10, fl, &sampling2);
+}
+
+// Writes a BitSampling, damages copies of its masks, and checks that Map
+// rejects them while it accepts the undamaged one.
+void TestCorruptBitSampling() {
+	printf("==== %s\n", __func__);
+	typedef slash::BitSampling<BitVector64> Hasher;
+
+	const int bd = 48, bk = 10, bl = 4;
+	Hasher sampling(bd, bk, bl, 1);
+	FILE *f = tmpfile();
+	size_t size = 0;
+	if (f != nullptr && sampling.Write(f)) {
+		size = (size_t)ftell(f);
+		rewind(f);
+	}
+	// Map needs a cache line aligned copy.
+	char *data = (char*)slash::alignedFloats(size/sizeof(float) + 1);
+	size = f == nullptr ? 0 : fread(data, 1, size, f);
+	if (f != nullptr) {
+		fclose(f);
+	}
+
+	// The masks of table 0 follow the header, see BitSampling::Write.
+	uint64_t *mask = (uint64_t*)(data + slash::alignedSize(24));
+	uint64_t original = *mask, low = original & -original;
+	size_t accepted = 0;
+	auto expectRejected = [&](const char *what, uint64_t m) {
+		*mask = m;
+		Hasher *h = Hasher::Map(data, size);
+		if (h != nullptr) {
+			printf("accepted: %s\n", what);
+			accepted++;
+			delete h;
+		}
+		*mask = original;
+	};
+	expectRejected("a position too many", original | ((original + 1) & ~original & (((uint64_t)1 << bd) - 1)));
+	expectRejected("a position too few", original & ~low);
+	expectRejected("a position at d or above", (original & ~low) | ((uint64_t)1 << (bd + 3)));
+
+	Hasher *mapped = Hasher::Map(data, size);
+	size_t mismatches = mapped == nullptr ? 1 : 0;
+	for (int i = 0; mapped != nullptr && i < 1000; i++) {
+		BitVector64 p(((uint64_t)random() << 32) | (uint64_t)random());
+		for (int t = 0; t < bl; t++) {
+			mismatches += mapped->HashTable(p, t) != sampling.HashTable(p, t);
+		}
+	}
+	printf("damaged masks accepted: %llu\n", (unsigned long long)accepted);
+	check(accepted == 0 && mismatches == 0, "BitSampling::Map rejects damaged masks");
+	delete mapped;
+	slash::freeAligned(data);
+}
+
+// A pair of points found by a similarity join, a < b.
+struct JoinPair {
+	slash::PointID a, b;
+	float similarity;
+
+	bool operator<(const JoinPair &q) const {
+		return this->a < q.a || (this->a == q.a && this->b < q.b);
+	}
+	bool operator==(const JoinPair &q) const {
+		return this->a == q.a && this->b == q.b && sameSimilarity(this->similarity, q.similarity);
+	}
+};
+
+// Joins index with itself, with the given threads, and returns the pairs
+// sorted and the time taken in del.
+template <class Index>
+std::vector<JoinPair> SelfJoin(Index &index, float threshold, int threads, double *del, slash::QueryStats *stats) {
+	timespec start, end;
+	std::vector<JoinPair> pairs;
+	index.SetThreads(threads);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t n = index.SelfJoin(threshold, [&](slash::PointID a, slash::PointID b, float similarity) {
+		pairs.push_back(JoinPair{a, b, similarity});
+	}, stats);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*del = (double)(end.tv_sec-start.tv_sec)+1e-9*(double)(end.tv_nsec-start.tv_nsec);
+	index.SetThreads(1);
+	if (n != pairs.size()) {
+		pairs.clear();
+	}
+	std::sort(pairs.begin(), pairs.end());
+	return pairs;
+}
+
+// Checks that SelfJoin finds the same pairs as QueryRange on every point,
+// before and after Freeze, with split buckets, and with several threads.
+void TestSelfJoin() {
+	printf("==== %s\n", __func__);
+
+	const float threshold = 0.8f;
+	const int jk = 2, jl = 4;
+	std::vector<BitVector64> vs = ClusteredCodes(20000, 2000);
+	slash::SLSH<BitVector64> hasher(64, jk, jl);
+	slash::LSH<BitVector64, slash::SLSH<BitVector64> > index(64, jk, jl, &hasher), split(64, jk, jl, &hasher);
+	index.Insert(vs);
+	split.Insert(vs);
+	split.SetSplit(20);
+	split.Freeze();
+
+	for (int frozen = 0; frozen < 2; frozen++) {
+		if (frozen == 1) {
+			index.Freeze();
+		}
+		timespec start, end;
+		std::vector<JoinPair> ref;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < vs.size(); i++) {
+			slash::PointID a = (slash::PointID)i;
+			index.QueryRange(a, threshold, [&](slash::PointID b, float similarity) {
+				if (a < b) {
+					ref.push_back(JoinPair{a, b, similarity});
+				}
+			});
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double refDel = (double)(end.tv_sec-start.tv_sec)+1e-9*(double)(end.tv_nsec-start.tv_nsec);
+		std::sort(ref.begin(), ref.end());
+
+		double del[2];
+		slash::QueryStats stats;
+		std::vector<JoinPair> one = SelfJoin(index, threshold, 1, &del[0], &stats);
+		std::vector<JoinPair> four = SelfJoin(index, threshold, 4, &del[1], nullptr);
+		printf("%s: %llu pairs, QueryRange on every point %gs, SelfJoin %gs, with 4 threads %gs\n",
+			frozen ? "frozen" : "not frozen", (unsigned long long)ref.size(), refDel, del[0], del[1]);
+		printf("pairs in buckets: %llu, left to an earlier table: %llu, scored: %llu\n",
+			(unsigned long long)stats.candidates, (unsigned long long)stats.duplicates, (unsigned long long)stats.evaluations);
+		printf("same pairs as QueryRange: %d, with 4 threads: %d\n", one == ref, four == ref);
+		check(one == ref && four == ref, "SelfJoin against QueryRange");
+	}
+
+	std::vector<JoinPair> ref;
+	for (size_t i = 0; i < vs.size(); i++) {
+		slash::PointID a = (slash::PointID)i;
+		split.QueryRange(a, threshold, [&](slash::PointID b, float similarity) {
+			if (a < b) {
+				ref.push_back(JoinPair{a, b, similarity});
+			}
+		});
+	}
+	std::sort(ref.begin(), ref.end());
+	double del;
+	std::vector<JoinPair> pairs = SelfJoin(split, threshold, 4, &del, nullptr);
+	printf("split: %llu pairs, same pairs as QueryRange: %d\n", (unsigned long long)ref.size(), pairs == ref);
+	check(pairs == ref, "SelfJoin against QueryRange with split buckets");
+}
+
+// Tunes k, L and probes for a recall target on clustered embeddings, then
+// builds the index with the tuning and measures its recall on the same queries.
+template <int D>
+void TestTune() {
+	printf("==== %s<%d>\n", __func__, D);
+
+	typedef DenseVector<D> Vector;
+	const size_t nPoints = 10000, nQueries = 200;
+	std::vector<Vector> vs = ClusteredPoints<D>(nPoints + nQueries, 500);
+	std::vector<Vector> queries(vs.end() - nQueries, vs.end());
+	vs.resize(nPoints);
+
+	slash::TuneOptions o;
+	o.limit = limit;
+	o.recall = 0.9;
+	o.maxK = 4;
+	o.maxL = 8;
+	o.maxProbes = 8;
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	slash::Tuning t = slash::Tune<Vector, slash::SLSH<Vector> >(D, vs, queries, o);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double del = (double)(end.tv_sec-start.tv_sec)+1e-9*(double)(end.tv_nsec-start.tv_nsec);
+	printf("Tune: %gs, met=%d k=%d L=%d probes=%d recall=%g candidates=%g %gB/pt latency=%gus\n",
+		del, (int)t.met, t.k, t.l, t.probes, t.recall, t.candidates, t.bytesPerPoint, 1e6*t.latency);
+
+	slash::SLSH<Vector> hasher(D, t.k, t.l);
+	slash::LSH<Vector, slash::SLSH<Vector> > index(D, t.k, t.l, &hasher);
+	index.Insert(vs);
+	index.Freeze();
+	index.SetProbes(t.probes);
+	double recall = 0, candidates = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::vector<std::vector<slash::Neighbor> > found;
+	for (size_t i = 0; i < nQueries; i++) {
+		slash::QueryStats stats;
+		found.push_back(index.Query(queries[i], limit, &stats));
+		candidates += (double)stats.candidates;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	for (size_t i = 0; i < nQueries; i++) {
+		recall += Recall(vs, queries[i], vs.size(), found[i]);
+	}
+	printf("Built: recall=%g, linearSearch=%g, %gB/pt, %g ns/op\n", recall/nQueries, candidates/nQueries, (double)index.Bytes()/nPoints, del/nQueries);
+}
+
+// Sums the query counters over many queries, checks that they add up, and
+// prints the shape of the tables.
+void TestStats() {
+	printf("==== %s\n", __func__);
+
+	const size_t nQueries = 10000;
+	slash::QueryStats s, into;
+	std::vector<slash::Neighbor> out(limit);
+	for (size_t i = 0; i < nQueries; i++) {
+		lsh->Query((slash::PointID)i, limit, &s);
+		lsh->QueryInto((slash::PointID)i, limit, out.data(), &into);
+	}
+	// Every point is in its own bucket in each table, and is skipped there.
+	size_t self = nQueries*L;
+	printf("per query: buckets=%g candidates=%g duplicates=%g evaluations=%g replacements=%g\n",
+		(double)s.buckets/nQueries, (double)s.candidates/nQueries, (double)s.duplicates/nQueries,
+		(double)s.evaluations/nQueries, (double)s.replacements/nQueries);
+	bool inconsistent = s.candidates != into.candidates || s.candidates != self + s.duplicates + s.evaluations;
+	printf("inconsistent counters: %d\n", (int)inconsistent);
+	check(!inconsistent, "query counters");
+
+	slash::IndexStats is = lsh->Stats(3);
+	printf("points=%llu pointBytes=%llu hashBytes=%llu binBytes=%llu\n", (unsigned long long)is.points,
+		(unsigned long long)is.pointBytes, (unsigned long long)is.hashBytes, (unsigned long long)is.binBytes);
+	for (size_t i = 0; i < is.tables.size(); i++) {
+		const slash::TableStats &t = is.tables[i];
+		printf("table %d: points=%llu buckets=%llu bytes=%llu sizes:", (int)i, (unsigned long long)t.points,
+			(unsigned long long)t.buckets, (unsigned long long)t.bytes);
+		for (size_t b = 0; b < t.histogram.size(); b++) {
+			printf(" [%llu,%llu]=%llu", 1ULL << b, (2ULL << b) - 1, (unsigned long long)t.histogram[b]);
+		}
+		printf(" largest:");
+		for (auto &bucket: t.largest) {
+			printf(" %llu", (unsigned long long)bucket.size);
+		}
+		printf("\n");
+	}
+}
+
+// Writes points to files of raw records and of .fvecs records, builds
+// indexes from them with InsertFile and InsertStream in small batches, and
+// compares their results with those of an index built with one Insert.
+void TestIngest() {
+	printf("==== %s\n", __func__);
+
+	typedef slash::LSH<BitVector64, slash::SLSH<BitVector64> > Index;
+	const size_t nPoints = 20000, batch = 3000, nQueries = 2000;
+	FILE *f = fopen("lsh_test.points", "wb");
+	fwrite(points.data(), sizeof(BitVector64), nPoints, f);
+	fclose(f);
+
+	slash::SLSH<BitVector64> hasher(d, k, L);
+	Index whole(d, k, L, &hasher), mapped(d, k, L, &hasher), streamed(d, k, L, &hasher);
+	whole.Insert(points.data(), nPoints);
+	size_t inserted[2];
+	bool ok = slash::InsertFile(mapped, "lsh_test.points", slash::RawRecord<BitVector64>(), batch, &inserted[0]);
+	f = fopen("lsh_test.points", "rb");
+	ok = slash::InsertStream(streamed, f, slash::RawRecord<BitVector64>(), batch, &inserted[1]) && ok;
+	fclose(f);
+	remove("lsh_test.points");
+	size_t mismatches = 0;
+	for (size_t i = 0; i < nQueries; i++) {
+		auto neighbors = whole.Query((slash::PointID)i, limit);
+		mismatches += neighbors != mapped.Query((slash::PointID)i, limit);
+		mismatches += neighbors != streamed.Query((slash::PointID)i, limit);
+	}
+	printf("raw: ok=%d, inserted %llu and %llu, queries with different results: %llu\n", (int)ok,
+		(unsigned long long)inserted[0], (unsigned long long)inserted[1], (unsigned long long)mismatches);
+	check(ok && inserted[0] == nPoints && inserted[1] == nPoints && mismatches == 0, "raw records ingested against Insert");
+
+	const int D = 128;
+	typedef DenseVector<D> Vector;
+	std::vector<Vector> vs = ClusteredPoints<D>(nPoints/4, 500);
+	f = fopen("lsh_test.fvecs", "wb");
+	for (auto &v: vs) {
+		int32_t dim = D;
+		float x[D];
+		v.Unpack(x);
+		fwrite(&dim, sizeof(dim), 1, f);
+		fwrite(x, sizeof(float), D, f);
+	}
+	fclose(f);
+
+	slash::SLSH<Vector> dense(D, 2, L);
+	slash::LSH<Vector, slash::SLSH<Vector> > fromVectors(D, 2, L, &dense), fromFile(D, 2, L, &dense);
+	fromVectors.Insert(vs);
+	slash::FloatRecord<Vector> fvecs = {D, true};
+	ok = slash::InsertFile(fromFile, "lsh_test.fvecs", fvecs, batch, &inserted[0]);
+	slash::FloatRecord<Vector> wrong = {D/2, true};
+	bool rejected = !slash::InsertFile(fromFile, "lsh_test.fvecs", wrong, batch);
+	remove("lsh_test.fvecs");
+	mismatches = 0;
+	for (size_t i = 0; i < nQueries; i++) {
+		mismatches += fromVectors.Query(vs[i], limit) != fromFile.Query(vs[i], limit);
+	}
+	printf("fvecs: ok=%d, inserted %llu, wrong dimension rejected=%d, queries with different results: %llu\n", (int)ok,
+		(unsigned long long)inserted[0], (int)rejected, (unsigned long long)mismatches);
+	check(ok && inserted[0] == vs.size() && rejected && mismatches == 0, ".fvecs records ingested against Insert");
+}
+
+// Builds an index over skewed data, where a third of the points are close
+// to one of a few hubs, with and without splitting large buckets, and
+// compares the candidates and recall of queries.
+void TestSplit() {
+	printf("==== %s\n", __func__);
+
+	const size_t nPoints = 30000, nHubs = 5, nQueries = 2000, threshold = 100;
+	std::vector<BitVector64> vs;
+	uint64_t hubs[nHubs];
+	for (size_t i = 0; i < nHubs; i++) {
+		hubs[i] = ((uint64_t)random() << 32) | (uint64_t)random();
+	}
+	for (size_t i = 0; i < nPoints; i++) {
+		uint64_t v = ((uint64_t)random() << 32) | (uint64_t)random();
+		if (i % 3 == 0) {
+			v = hubs[i % nHubs] ^ ((uint64_t)1 << (random() % 64)) ^ ((uint64_t)1 << (random() % 64));
+		}
+		vs.push_back(BitVector64(v));
+	}
+
+	slash::SLSH<BitVector64> hasher(d, k, L);
+	slash::LSH<BitVector64, slash::SLSH<BitVector64> > whole(d, k, L, &hasher), split(d, k, L, &hasher);
+	split.SetSplit(threshold);
+	whole.Insert(vs);
+	split.Insert(vs);
+	whole.Freeze();
+	split.Freeze();
+
+	for (int t = 0; t < 2; t++) {
+		auto index = t == 0 ? &whole : &split;
+		slash::IndexStats s = index->Stats(1);
+		size_t largest = 0, splits = 0;
+		for (auto &table: s.tables) {
+			largest = std::max(largest, table.largest.empty() ? 0 : table.largest[0].size);
+			splits += table.splits;
+		}
+
+		double recall = 0;
+		size_t candidates = 0, most = 0;
+		for (size_t i = 0; i < nQueries; i++) {
+			slash::QueryStats stats;
+			auto neighbors = index->Query((slash::PointID)i, limit, &stats);
+			recall += Recall(vs, i, neighbors);
+			candidates += stats.candidates;
+			most = std::max(most, stats.candidates);
+		}
+		printf("%s: largest bucket=%llu, splits=%llu, linearSearch=%g (at most %llu), recall@%d=%g\n", t == 0 ? "whole" : "split",
+			(unsigned long long)largest, (unsigned long long)splits, (double)candidates/nQueries, (unsigned long long)most, limit, recall/nQueries);
+	}
+
+	split.Save("lsh_test.idx");
+	auto mapped = slash::LSH<BitVector64, slash::SLSH<BitVector64> >::Open("lsh_test.idx");
+	size_t mismatches = mapped == nullptr ? nQueries : 0;
+	for (size_t i = 0; mapped != nullptr && i < nQueries; i++) {
+		if (mapped->Query((slash::PointID)i, limit) != split.Query((slash::PointID)i, limit)) {
+			mismatches++;
+		}
+	}
+	printf("mapped queries with different results: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "opened queries against saved ones");
+	delete mapped;
+	remove("lsh_test.idx");
+}
+
+// Inserts points into a concurrent index in batches while reader threads
+// query it, then compares its results with those of a single frozen index
+// over the same points.
+void TestConcurrent() {
+	printf("==== %s\n", __func__);
+
+	const size_t nPoints = 50000, chunk = 1000, batch = 5000, nReaders = 2, nQueries = 2000;
+	slash::SLSH<BitVector64> hasher(d, k, L);
+	slash::ConcurrentLSH<BitVector64, slash::SLSH<BitVector64> > index(d, k, L, &hasher);
+	index.SetBatchSize(batch);
+
+	std::atomic<bool> done(false);
+	std::atomic<size_t> queries(0), invalid(0);
+	std::vector<std::thread> readers;
+	for (size_t t = 0; t < nReaders; t++) {
+		readers.push_back(std::thread([&, t]() {
+			size_t i = t;
+			while (!done.load()) {
+				size_t n = index.Size();
+				if (n == 0) {
+					std::this_thread::yield();
+					continue;
+				}
+				auto neighbors = i % 2 == 0 ? index.Query((slash::PointID)(i % n), limit) : index.Query(points[i % nPoints], limit);
+				size_t size = index.Size();
+				for (auto &neighbor: neighbors) {
+					invalid += neighbor.id >= size || (i % 2 == 0 && neighbor.id == i % n);
+				}
+				queries++;
+				i += nReaders;
+			}
+		}));
+	}
+
+	for (size_t i = 0; i < nPoints; i += chunk) {
+		index.Insert(&points[i], chunk);
+	}
+	index.Publish();
+	done.store(true);
+	for (auto &reader: readers) {
+		reader.join();
+	}
+
+	slash::LSH<BitVector64, slash::SLSH<BitVector64> > whole(d, k, L, &hasher);
+	whole.Insert(points.data(), nPoints);
+	whole.Freeze();
+	size_t mismatches = 0;
+	for (size_t i = 0; i < nQueries; i++) {
+		auto a = index.Query((slash::PointID)i, limit), b = whole.Query((slash::PointID)i, limit);
+		bool same = a.size() == b.size();
+		for (size_t j = 0; same && j < a.size(); j++) {
+			same = a[j].similarity == b[j].similarity;
+		}
+		mismatches += !same;
+	}
+
+	size_t freed, versions = index.Versions(&freed);
+	printf("queries during inserts: %llu, invalid neighbors: %llu\n", (unsigned long long)queries.load(), (unsigned long long)invalid.load());
+	printf("points=%llu segments=%llu versions=%llu freed=%llu\n", (unsigned long long)index.Size(),
+		(unsigned long long)index.Segments(), (unsigned long long)versions, (unsigned long long)freed);
+	printf("queries with different results than a single index: %llu\n", (unsigned long long)mismatches);
+	check(invalid.load() == 0 && mismatches == 0, "ConcurrentLSH against a single index");
+}
+
+// Checks that queries made from a QueryRange callback do not disturb the
+// query that called them: the same points are reported, once each.
+void TestNestedQuery() {
+	printf("==== %s\n", __func__);
+
+	const float threshold = 0.7f;
+	std::vector<BitVector64> vs = ClusteredCodes(20000, 2000);
+	slash::SLSH<BitVector64> hasher(64, 2, 8);
+	slash::LSH<BitVector64, slash::SLSH<BitVector64> > index(64, 2, 8, &hasher);
+	index.Insert(vs);
+
+	size_t lost = 0, repeated = 0, reported = 0;
+	for (size_t i = 0; i < 200; i++) {
+		slash::PointID q = (slash::PointID)i;
+		std::vector<slash::PointID> plain, nested;
+		index.QueryRange(q, threshold, [&](slash::PointID id, float) {
+			plain.push_back(id);
+		});
+		index.QueryRange(q, threshold, [&](slash::PointID id, float) {
+			nested.push_back(id);
+			index.Query(id, 3);
+			index.QueryRange(id, threshold, [](slash::PointID, float) {});
+		});
+		std::sort(plain.begin(), plain.end());
+		std::sort(nested.begin(), nested.end());
+		repeated += nested.end() - std::unique(nested.begin(), nested.end());
+		nested.erase(std::unique(nested.begin(), nested.end()), nested.end());
+		lost += plain != nested;
+		reported += plain.size();
+	}
+	printf("%llu points reported, queries with lost points: %llu, points reported twice: %llu\n",
+		(unsigned long long)reported, (unsigned long long)lost, (unsigned long long)repeated);
+	check(lost == 0 && repeated == 0, "queries nested in a QueryRange callback");
+}
+
+// Checks that queries with a limit of 0 or 1 return nothing and the best
+// neighbor, respectively.
+void TestQueryLimits() {
+	printf("==== %s\n", __func__);
+
+	size_t wrong = 0;
+	slash::Neighbor out[1];
+	for (size_t i = 0; i < 1000; i++) {
+		slash::PointID id = (slash::PointID)i;
+		auto all = lsh->Query(id, limit);
+		auto none = lsh->Query(id, 0);
+		auto one = lsh->Query(id, 1);
+		int into = lsh->QueryInto(id, 0, out);
+		wrong += !none.empty() || into != 0 || one.size() != std::min<size_t>(1, all.size()) ||
+			(!one.empty() && one[0].similarity != all[0].similarity);
+	}
+	printf("queries with a wrong result: %llu\n", (unsigned long long)wrong);
+	check(wrong == 0, "queries with limits 0 and 1");
+}
+
+// Checks QueryInto against Query, and QueryRange against the candidates
+// scored by Query: with no threshold it reports all of them, and with one
+// it reports those of the neighbors above it.
+void TestQueryRange() {
+	printf("==== %s\n", __func__);
+
+	const size_t nQueries = 10000;
+	const float threshold = 0.7f;
+	std::vector<std::vector<slash::Neighbor> > found(nQueries);
+	std::vector<slash::QueryStats> stats(nQueries);
+	std::vector<slash::Neighbor> buffer(nQueries*limit);
+	std::vector<int> sizes(nQueries);
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < nQueries; i++) {
+		found[i] = lsh->Query((slash::PointID)i, limit, &stats[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < nQueries; i++) {
+		sizes[i] = lsh->QueryInto((slash::PointID)i, limit, &buffer[i*limit]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double intoDel = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+
+	size_t intoMismatches = 0, rangeMismatches = 0, reported = 0;
+	for (size_t i = 0; i < nQueries; i++) {
+		const std::vector<slash::Neighbor> &neighbors = found[i];
+		intoMismatches += neighbors != std::vector<slash::Neighbor>(&buffer[i*limit], &buffer[i*limit] + sizes[i]);
+
+		size_t all = lsh->QueryRange((slash::PointID)i, -2.0f, [](slash::PointID, float) {});
+		std::vector<slash::Neighbor> above;
+		lsh->QueryRange((slash::PointID)i, threshold, [&](slash::PointID id, float similarity) {
+			slash::Neighbor neighbor = {id, similarity};
+			above.push_back(neighbor);
+		});
+		reported += above.size();
+		bool same = all == stats[i].evaluations;
+		for (auto &neighbor: above) {
+			same = same && neighbor.similarity >= threshold && neighbor.id != (slash::PointID)i &&
+				fabsf(neighbor.similarity - points[neighbor.id].Similarity(points[i])) < 1e-6f;
+		}
+		for (auto &neighbor: neighbors) {
+			if (neighbor.similarity >= threshold) {
+				same = same && std::find(above.begin(), above.end(), neighbor) != above.end();
+			}
+		}
+		rangeMismatches += !same;
+	}
+	printf("Query: %g ns/op, QueryInto: %g ns/op\n", del/nQueries, intoDel/nQueries);
+	printf("QueryInto different from Query: %llu, QueryRange inconsistent: %llu, %g points/op at least %g similar\n",
+		(unsigned long long)intoMismatches, (unsigned long long)rangeMismatches, (double)reported/nQueries, threshold);
+	check(intoMismatches == 0 && rangeMismatches == 0, "QueryInto and QueryRange against Query");
+}
+
+// Answers the same queries with Query one at a time and with QueryBatch,
+// checks that the results and the counters are the same, and compares the
+// throughput.
+void TestQueryBatch() {
+	printf("==== %s\n", __func__);
+
+	const size_t nQueries = 50000;
+	std::vector<BitVector64> queries;
+	for (size_t i = 0; i < nQueries; i++) {
+		queries.push_back(BitVector64(((uint64_t)random() << 32) | (uint64_t)random()));
+	}
+
+	timespec start, end;
+	slash::QueryStats single, batch;
+	std::vector<std::vector<slash::Neighbor> > found(nQueries);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < nQueries; i++) {
+		found[i] = lsh->Query(queries[i], limit, &single);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double del = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	auto batched = lsh->QueryBatch(queries, limit, &batch);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double batchDel = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < nQueries; i++) {
+		mismatches += found[i] != batched[i];
+	}
+	bool sameStats = single.buckets == batch.buckets && single.candidates == batch.candidates &&
+		single.duplicates == batch.duplicates && single.evaluations == batch.evaluations && single.replacements == batch.replacements;
+	printf("Query: %g ns/op, QueryBatch: %g ns/op\n", del/nQueries, batchDel/nQueries);
+	printf("queries with different results: %llu, same counters: %d\n", (unsigned long long)mismatches, (int)sameStats);
+	check(mismatches == 0 && sameStats, "QueryBatch against Query");
+}
+
+// Times QueryBatch for a range of group sizes on an index too large for the
+// last level cache, hashed by BitSampling so that lookups rather than
+// hashing dominate, and checks that it answers like Query.
+void BenchmarkQueryBatch() {
+	printf("==== %s\n", __func__);
+
+	const size_t nPoints = 8000000, nQueries = 100000;
+	const int bk = 20, bl = 4;
+	std::vector<BitVector64> vs(nPoints), queries(nQueries);
+	for (size_t i = 0; i < nPoints; i++) {
+		vs[i] = BitVector64(((uint64_t)random() << 32) | (uint64_t)random());
+	}
+	for (size_t i = 0; i < nQueries; i++) {
+		queries[i] = vs[(size_t)random() % nPoints];
+	}
+
+	typedef slash::BitSampling<BitVector64> Hasher;
+	Hasher hasher(64, bk, bl, 1);
+	slash::LSH<BitVector64, Hasher> index(64, bk, bl, &hasher);
+	index.Insert(vs);
+	index.Freeze();
+	printf("index: %g MB\n", (double)index.Bytes()/(1024*1024));
+
+	timespec start, end;
+	std::vector<std::vector<slash::Neighbor> > found(nQueries);
+	double del = 0;
+	for (int run = 0; run < 3; run++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < nQueries; i++) {
+			found[i] = index.Query(queries[i], limit);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double d = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+		del = run == 0 || d < del ? d : del;
+	}
+	printf("Query: %g ns/op\n", del/nQueries);
+
+	// The best of a few runs, as the machine may be noisy.
+	// The results are reused across runs, as a serving loop would.
+	size_t groups[] = {1, 2, 4, 8, 16, 32, 64, 128};
+	size_t mismatches = 0;
+	std::vector<std::vector<slash::Neighbor> > batched(nQueries);
+	for (size_t group : groups) {
+		index.SetBatchGroup(group);
+		double batchDel = 0;
+		for (int run = 0; run < 3; run++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			index.QueryBatch(queries.data(), nQueries, limit, batched.data());
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			double d = 1e9*(double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec);
+			batchDel = run == 0 || d < batchDel ? d : batchDel;
+			for (size_t i = 0; i < nQueries; i++) {
+				mismatches += found[i] != batched[i];
+			}
+		}
+		printf("QueryBatch, groups of %llu: %g ns/op (speedup %gx)\n", (unsigned long long)group, batchDel/nQueries, del/batchDel);
+	}
+	printf("queries with different results: %llu\n", (unsigned long long)mismatches);
+	check(mismatches == 0, "QueryBatch against Query for every group size");
 }
 
 void BenchmarkQuery() {
@@ -113,12 +1499,12 @@ void BenchmarkQuery() {
 
 	clock_gettime(CLOCK_MONOTONIC, &start);
 	for (size_t i=0; i<NQUERIES; i++) {
-		size_t linearSearchSize = 0;
+		slash::QueryStats stats;
 		
-		auto neighbors = lsh->Query(points[i % (size_t)NPOINTS], limit, &linearSearchSize);
+		auto neighbors = lsh->Query((slash::PointID)(i % (size_t)NPOINTS), limit, &stats);
 		
-		totalLinearSearchSize += (double)linearSearchSize;
-		if ((double)linearSearchSize > NPOINTS*BAD_LINEAR_SEARCH_FRACTION) {
+		totalLinearSearchSize += (double)stats.candidates;
+		if ((double)stats.candidates > NPOINTS*BAD_LINEAR_SEARCH_FRACTION) {
 			badLinearSearch++;
 		}
 		
@@ -142,13 +1528,45 @@ int main() {
 	init();
 
 	TestLinearSearch();
+	TestHashBatch();
 	TestInsert();
+	TestParallelInsert();
+	TestFreeze();
 	TestQuery();
+	TestQueryNew();
+	TestMultiProbe();
+	TestBitVector<256>();
+	TestBitVector<1024>();
+	TestDenseVector<128>();
+	TestRotations();
+	TestFastSLSH<256>();
+	TestQuantized<BitVector64>("BitVector64", d, points);
+	TestQuantized<DenseVector<256> >("DenseVector<256>", 256, ClusteredPoints<256>(20000, 1000));
+	TestTable<BitVector64>("BitVector64", d, points);
+	TestTable<BitVector<128> >("BitVector<128>", 128, RandomCodes<128>(20000));
+	TestFamilies();
+	TestCorruptBitSampling();
+	TestSelfJoin();
+	TestTune<128>();
+	TestIngest();
+	TestSplit();
+	TestConcurrent();
 	
+	TestStats();
+	TestQueryBatch();
+	BenchmarkQuery();
+
+	lsh->Freeze();
+	TestStats();
+	TestQueryBatch();
+	TestQueryRange();
+	TestQueryLimits();
+	TestNestedQuery();
 	BenchmarkQuery();
+	BenchmarkQueryBatch();
 
 	delete slsh;
 	delete lsh;
 	
-	return 0;
+	return failures != 0;
 }
@@ -0,0 +1,83 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mappedfile.h"
+
+namespace slash {
+
+bool MappedFile::Open(const char *path) {
+	this->Close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+
+	this->data = (const char*)p;
+	this->size = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (this->data != nullptr) {
+		munmap((void*)this->data, this->size);
+		this->data = nullptr;
+		this->size = 0;
+	}
+}
+
+void MappedFile::Release(size_t offset, size_t n) {
+	if (offset >= this->size) {
+		return;
+	}
+	n = n < this->size - offset ? n : this->size - offset;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	uintptr_t begin = (uintptr_t)(this->data + offset), end = begin + n;
+	begin = (begin + page - 1) / page * page;
+	end = end / page * page;
+	if (begin < end) {
+		madvise((void*)begin, end - begin, MADV_DONTNEED);
+	}
+}
+
+bool writeAligned(FILE *f, const void *data, size_t n) {
+	static const char zeros[CacheLine] = {0};
+
+	if (n > 0 && fwrite(data, 1, n, f) != n) {
+		return false;
+	}
+	size_t pad = alignedSize(n) - n;
+	return pad == 0 || fwrite(zeros, 1, pad, f) == pad;
+}
+
+};
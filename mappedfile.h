@@ -0,0 +1,81 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_MAPPEDFILE_H
+#define SLASH_MAPPEDFILE_H
+
+#include <stdio.h>
+#include "types.h"
+
+namespace slash {
+
+// MappedFile maps a whole file read-only into memory. Pages are shared with
+// every other process mapping the same file.
+class MappedFile {
+	const char *data;
+	size_t size;
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile &operator=(const MappedFile&) = delete;
+
+public:
+	MappedFile() : data(nullptr), size(0) {
+	}
+
+	~MappedFile() {
+		this->Close();
+	}
+
+	// Maps the file at path. Returns false on error.
+	bool Open(const char *path);
+	void Close();
+
+	inline const char *Data() const {
+		return this->data;
+	}
+
+	inline size_t Size() const {
+		return this->size;
+	}
+
+	// Drops the pages that lie entirely within the n bytes at offset from
+	// memory. They are read again from the file if accessed later. Lets a
+	// file be read once from start to end without all of it staying resident.
+	void Release(size_t offset, size_t n);
+};
+
+// Writes n bytes of data to f, followed by zeros up to alignedSize(n).
+// Returns false on error.
+bool writeAligned(FILE *f, const void *data, size_t n);
+
+// Returns true if n elements of elemSize bytes, padded up to a cache line
+// like writeAligned does, fit in the size bytes past offset at, and then
+// advances at past them. Overflow-safe, for the counts read from a file.
+inline bool nextBlock(size_t *at, uint64_t n, size_t elemSize, size_t size) {
+	if (*at > size || (elemSize > 0 && n > (size - *at)/elemSize)) {
+		return false;
+	}
+	size_t bytes = alignedSize((size_t)n*elemSize);
+	if (bytes > size - *at) {
+		return false;
+	}
+	*at += bytes;
+	return true;
+}
+
+};
+
+#endif  // SLASH_MAPPEDFILE_H
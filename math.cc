@@ -14,31 +14,72 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <string.h>
+#include <vector>
 #include "math.h"
 
 namespace slash {
 
-// Calculates a d-dimensional random dvectortortor using d random number generators.
-std::vector<dvector> randomRotation(int d, rng *r) {
-	std::vector<dvector> R(d);
-	
-	for (size_t i=0; i<(size_t)d; i++) {
-		R[i].random(d, r);
-		dvector &u = R[i];
-		for (size_t j=0; j<i; j++) {
-			dvector &v = R[j];
-			float vnorm = v.norm();
-			if (vnorm == 0) {
-				return randomRotation(d, r);
+void randomRotation(int d, counterRng &r, float *out, size_t stride) {
+	std::vector<double> q((size_t)d*d);
+	for (int i=0; i<d; i++) {
+		double *u = &q[(size_t)i*d];
+		double norm = 0;
+		while (norm == 0) {
+			for (int t=0; t<d; t++) {
+				u[t] = r.Normal();
+			}
+			// Each projection is taken from u as updated by the previous
+			// ones, which keeps the rows orthogonal to working precision.
+			for (int j=0; j<i; j++) {
+				const double *v = &q[(size_t)j*d];
+				double dot = 0;
+				for (int t=0; t<d; t++) {
+					dot += u[t]*v[t];
+				}
+				for (int t=0; t<d; t++) {
+					u[t] -= dot*v[t];
+				}
+			}
+			for (int t=0; t<d; t++) {
+				norm += u[t]*u[t];
+			}
+			norm = sqrt(norm);
+		}
+		for (int t=0; t<d; t++) {
+			u[t] /= norm;
+			out[(size_t)i*stride + t] = (float)u[t];
+		}
+	}
+}
+
+float *alignedFloats(size_t n) {
+	return (float*)alignedBytes(n*sizeof(float));
+}
+
+int8_t *alignedBytes(size_t n) {
+	void *p = 0;
+	if (posix_memalign(&p, CacheLine, n) != 0) {
+		abort();
+	}
+	memset(p, 0, n);
+	return (int8_t*)p;
+}
+
+void freeAligned(void *p) {
+	free(p);
+}
+
+void walshHadamard(float *x, size_t n) {
+	for (size_t h=1; h<n; h*=2) {
+		for (size_t i=0; i<n; i+=2*h) {
+			for (size_t j=i; j<i+h; j++) {
+				float a = x[j], b = x[j+h];
+				x[j] = a + b;
+				x[j+h] = a - b;
 			}
-			dvector vs(v);
-			vs.scale(v.dot(u)/vnorm);
-			u.sub(vs);
 		}
-		u.scale(1.0f/u.norm());
 	}
-	
-	return R;
-} 
+}
 
 };
\ No newline at end of file
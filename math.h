@@ -18,100 +18,83 @@
 #define SLASH_MATH_H
 
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <vector>
-#include <random>
 #include <assert.h>
+#include "types.h"
 
 namespace slash {
 
-class rng {
-  std::default_random_engine generator;
-  std::normal_distribution<float> distribution;
-public:
- 	rng() {
-		this->generator.seed(rand());
-		this->distribution = std::normal_distribution<float>(0.0f, 1.0f);
-	}
+// Counter-based random number generator. The i-th number of stream s of a
+// seed is a hash of (seed, s, i), so every stream can be drawn on its own,
+// on any thread, and gives the same numbers. The hash is the splitmix64
+// finalizer, and the counter steps by the splitmix64 increment.
+class counterRng {
+	uint64_t key;
+	uint64_t counter;
+	double spare;
+	bool hasSpare;
 
-	float Float() {
-		return this->distribution(this->generator);
+	static inline uint64_t mix(uint64_t x) {
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
 	}
-};
 
-class dvector {
 public:
-	float *v;
-	size_t l;
-	float norm() {
-		float n=0;
-		for (size_t i=0; i<this->l; i++) {
-			n += this->v[i]*this->v[i];
-		}
-		return sqrtf(n);
-	}
-	
-	void scale(float s) {
-		for (size_t i=0; i<this->l; i++) {
-			v[i] *= s;
-		}
+	counterRng(uint64_t seed, uint64_t stream) : counter(0), spare(0), hasSpare(false) {
+		this->key = mix(seed ^ mix(stream + 0x9e3779b97f4a7c15ULL));
 	}
-	
-	float dot(const dvector &u) {
-		float s=0;
-		for (size_t i=0; i<this->l; i++) {
-			s += this->v[i] * u.v[i];
-		}
-		return s;
-	}
-	
-	void sub(const dvector &u) {
-		for (size_t i=0; i<this->l; i++) {
-			this->v[i] -= u.v[i];
-		}
-	}
-	
-	void random(size_t d, rng *r)  {
-		if (this->v != 0) {
-			delete [] this->v;
-			this->v = 0;
-		}
 
-		this->v = new float[d];
-		this->l = d;
-
-		for (size_t i=0; i<d; i++) {
-			this->v[i] = r[i].Float();
-		}
+	inline uint64_t Next() {
+		this->counter++;
+		return mix(this->key + this->counter*0x9e3779b97f4a7c15ULL);
 	}
 
-	dvector() {
-		this->v = 0;
-		this->l = 0;
+	// Returns a uniform number in (0, 1).
+	inline double Uniform() {
+		return ((double)(this->Next() >> 11) + 0.5) * (1.0/9007199254740992.0);
 	}
 
-	explicit dvector(size_t d) {
-		this->v = new float[d];
-		this->l = d;
-	}
-	
-	dvector(const dvector &u) {
-		this->v = new float[u.l];
-		for (size_t i = 0; i < u.l; i++) {
-			this->v[i] = u.v[i];
-		}
-		this->l = u.l;
-	}
-	
-	~dvector() {
-		if (this->l) {
-			delete [] this->v;
+	// Returns a standard normal number, by the Box-Muller transform.
+	inline double Normal() {
+		if (this->hasSpare) {
+			this->hasSpare = false;
+			return this->spare;
 		}
+		double r = sqrt(-2*log(this->Uniform())), t = 2*M_PI*this->Uniform();
+		this->spare = r*sin(t);
+		this->hasSpare = true;
+		return r*cos(t);
 	}
-
 };
 
-std::vector<dvector> randomRotation(int d, rng *r);
+// Returns a seed drawn from rand, for hashers built without an explicit
+// seed, so that srand still makes them reproducible.
+inline uint64_t randomSeed() {
+	return ((uint64_t)(unsigned int)rand() << 32) ^ (uint64_t)(unsigned int)rand();
+}
+
+// Stores a uniformly random d by d rotation matrix drawn from r in out,
+// row i at out + i*stride. Rows are normal vectors orthonormalized by
+// modified Gram-Schmidt in doubles, in a single contiguous buffer.
+void randomRotation(int d, counterRng &r, float *out, size_t stride);
+
+// Applies the unnormalized Walsh-Hadamard transform to the n floats of x in
+// place, n a power of two. Multiplies the norm of x by sqrt(n).
+void walshHadamard(float *x, size_t n);
+
+// Returns the number of floats needed to hold n floats padded up to a whole cache line.
+inline size_t paddedFloats(size_t n) {
+	const size_t perLine = CacheLine/sizeof(float);
+	return (n + perLine - 1) / perLine * perLine;
+}
+
+// Allocates n zeroed floats aligned to a cache line. Release with freeAligned.
+float *alignedFloats(size_t n);
+// Same as above, for n bytes.
+int8_t *alignedBytes(size_t n);
+void freeAligned(void *p);
 
 };
 
@@ -0,0 +1,137 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_MULTIPROBE_H
+#define SLASH_MULTIPROBE_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include "types.h"
+
+namespace slash {
+
+// Multi-probe support for hashes made of k orthoplex vertices, as computed
+// by SLSH and FastSLSH. Alternatives come in order of increasing distance,
+// enumerated with the heap-based scheme of Q. Lv et al.,
+// ``Multi-Probe LSH: Efficient Indexing for High-Dimensional Similarity Search'', VLDB 2007.
+
+// A runner-up vertex for the j-th elementary hash of a table, and the
+// difference between its score and the score of the chosen vertex.
+struct perturbation {
+	float gap;
+	int j;
+	int vertex;
+
+	bool operator<(const perturbation &q) const {
+		return this->gap < q.gap;
+	}
+};
+
+// A set of perturbations, given by ascending indices into a list of
+// perturbations sorted by gap, and the sum of their gaps.
+struct probeSet {
+	float score;
+	std::vector<int> members;
+
+	bool operator<(const probeSet &q) const {
+		return this->score > q.score;  // priority_queue pops the least score first.
+	}
+};
+
+// Appends to ps the keep runner-up vertices of smallest gap for the j-th
+// elementary hash, which chose vertex maxi with score max among the 2n
+// vertices scored by dots: vertex r (r+n) scores dots[r] (its negation).
+inline void addPerturbations(const float *dots, int n, int j, int maxi, float max, int keep, std::vector<perturbation> &ps) {
+	size_t first = ps.size();
+	for (int r=0; r<n; r++) {
+		float dot = dots[r];
+		float abs = dot>=0?dot:-dot;
+		int near = dot >= 0 ? r : r + n;
+		int far = dot >= 0 ? r + n : r;
+		if (near != maxi) {
+			perturbation q = {max - abs, j, near};
+			ps.push_back(q);
+		}
+		perturbation q = {max + abs, j, far};
+		ps.push_back(q);
+	}
+	if (ps.size() - first > (size_t)keep) {
+		std::partial_sort(ps.begin() + first, ps.begin() + first + keep, ps.end());
+		ps.resize(first + keep);
+	}
+}
+
+// Stores in out the n hashes obtained by applying the n perturbation sets
+// of smallest score to base, whose elementary hashes take hbits bits each,
+// skipping sets that perturb the same elementary hash twice. ps must be
+// sorted by gap. Slots left over when ps runs out of sets are filled with base.
+inline void enumerateProbes(const std::vector<perturbation> &ps, int n, unsigned int hbits, HashType base, HashType *out) {
+	int produced = 0;
+	std::priority_queue<probeSet> heap;
+	HashType field = ((HashType)1 << hbits) - 1;
+
+	if (!ps.empty()) {
+		probeSet first;
+		first.score = ps[0].gap;
+		first.members.push_back(0);
+		heap.push(first);
+	}
+
+	while (produced < n && !heap.empty()) {
+		probeSet a = heap.top();
+		heap.pop();
+
+		int m = a.members.back();
+		if (m+1 < (int)ps.size()) {
+			probeSet shift = a;
+			shift.members.back() = m+1;
+			shift.score += ps[m+1].gap - ps[m].gap;
+			heap.push(shift);
+
+			probeSet expand = a;
+			expand.members.push_back(m+1);
+			expand.score += ps[m+1].gap;
+			heap.push(expand);
+		}
+
+		HashType h = base;
+		uint64_t seen = 0;  // bit j is set if elementary hash j is perturbed.
+		bool valid = true;
+		for (int i: a.members) {
+			const perturbation &q = ps[i];
+			if (seen & ((uint64_t)1 << q.j)) {
+				valid = false;
+				break;
+			}
+			seen |= (uint64_t)1 << q.j;
+			HashType shift = (HashType)(hbits*q.j);
+			h = (h & ~(field << shift)) | ((HashType)q.vertex << shift);
+		}
+		if (valid) {
+			out[produced++] = h;
+		}
+	}
+
+	for (; produced < n; produced++) {
+		out[produced] = base;
+	}
+}
+
+};
+
+#endif  // SLASH_MULTIPROBE_H
@@ -0,0 +1,70 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_PARALLEL_H
+#define SLASH_PARALLEL_H
+
+#include <stddef.h>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace slash {
+
+// Returns the number of threads to use for a requested count of n.
+// n <= 0 means one thread per hardware thread.
+inline int threadCount(int n) {
+	if (n > 0) {
+		return n;
+	}
+	int hw = (int)std::thread::hardware_concurrency();
+	return hw > 0 ? hw : 1;
+}
+
+// Splits [0, n) into at most threads contiguous ranges and calls
+// f(begin, end) for each of them on its own thread. The calling thread
+// runs the first range itself. Returns after all ranges are done.
+template <class F>
+void parallelFor(int threads, size_t n, const F &f) {
+	if (threads > (int)n) {
+		threads = (int)n;
+	}
+	if (threads <= 1) {
+		if (n > 0) {
+			f((size_t)0, n);
+		}
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	workers.reserve(threads-1);
+	size_t chunk = n / threads, rest = n % threads;
+	size_t begin = chunk + (rest > 0 ? 1 : 0);
+	for (int t = 1; t < threads; t++) {
+		size_t end = begin + chunk + ((size_t)t < rest ? 1 : 0);
+		workers.push_back(std::thread(std::cref(f), begin, end));
+		begin = end;
+	}
+	f((size_t)0, chunk + (rest > 0 ? 1 : 0));
+
+	for (auto &w: workers) {
+		w.join();
+	}
+}
+
+};
+
+#endif  // SLASH_PARALLEL_H
@@ -0,0 +1,189 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_POPCOUNT_H
+#define SLASH_POPCOUNT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+namespace slash {
+
+// Returns sum plus the elements of u at the set bits of x, added byte by
+// byte: the elements of each byte are summed in increasing bit order from 0,
+// then the byte sums are added to sum in increasing byte order. The binary
+// feature vectors compute Dot this way so that TableSLSH, which looks the
+// byte sums up, gets exactly the same result.
+inline float dotBytes(uint64_t x, const float *u, float sum) {
+	for (; x; x >>= 8, u += 8) {
+		uint32_t b = (uint32_t)x & 0xff;
+		if (b == 0) {
+			continue;
+		}
+		float partial = 0;
+		const float *ub = u;
+		for (; b; b &= b - 1) {
+			partial += ub[__builtin_ctz(b)];
+		}
+		sum += partial;
+	}
+	return sum;
+}
+
+// Adds to sums[t], for t < 16, the elements of column t of tile at the set
+// bits of x, exactly like sums[t] = dotBytes(x, u, sums[t]) with u[c] =
+// tile[16*c + t]: tile holds 64 rows of 16 floats, and the columns are
+// summed in vector lanes in the same order as dotBytes. This is how SLSH
+// dots a binary code with 16 rotation rows at once.
+inline void dotBytesTile(uint64_t x, const float *tile, float *sums) {
+#if defined(__AVX512F__)
+	__m512 s = _mm512_loadu_ps(sums);
+	for (; x; x >>= 8, tile += 8*16) {
+		uint32_t b = (uint32_t)x & 0xff;
+		if (b == 0) {
+			continue;
+		}
+		__m512 partial = _mm512_loadu_ps(tile + 16*__builtin_ctz(b));
+		for (b &= b - 1; b; b &= b - 1) {
+			partial = _mm512_add_ps(partial, _mm512_loadu_ps(tile + 16*__builtin_ctz(b)));
+		}
+		s = _mm512_add_ps(s, partial);
+	}
+	_mm512_storeu_ps(sums, s);
+#elif defined(__AVX2__)
+	__m256 s0 = _mm256_loadu_ps(sums), s1 = _mm256_loadu_ps(sums + 8);
+	for (; x; x >>= 8, tile += 8*16) {
+		uint32_t b = (uint32_t)x & 0xff;
+		if (b == 0) {
+			continue;
+		}
+		const float *row = tile + 16*__builtin_ctz(b);
+		__m256 p0 = _mm256_loadu_ps(row), p1 = _mm256_loadu_ps(row + 8);
+		for (b &= b - 1; b; b &= b - 1) {
+			row = tile + 16*__builtin_ctz(b);
+			p0 = _mm256_add_ps(p0, _mm256_loadu_ps(row));
+			p1 = _mm256_add_ps(p1, _mm256_loadu_ps(row + 8));
+		}
+		s0 = _mm256_add_ps(s0, p0);
+		s1 = _mm256_add_ps(s1, p1);
+	}
+	_mm256_storeu_ps(sums, s0);
+	_mm256_storeu_ps(sums + 8, s1);
+#else
+	for (int t = 0; t < 16; t++) {
+		float sum = sums[t];
+		for (uint64_t y = x, c = 0; y; y >>= 8, c += 8) {
+			uint32_t b = (uint32_t)y & 0xff;
+			if (b == 0) {
+				continue;
+			}
+			float partial = 0;
+			for (; b; b &= b - 1) {
+				partial += tile[16*(c + __builtin_ctz(b)) + t];
+			}
+			sum += partial;
+		}
+		sums[t] = sum;
+	}
+#endif
+}
+
+// Returns the bits of x selected by mask, packed into the low bits in
+// increasing order. A single PEXT instruction where BMI2 is available.
+inline uint64_t extractBits(uint64_t x, uint64_t mask) {
+#ifdef __BMI2__
+	return _pext_u64(x, mask);
+#else
+	uint64_t out = 0;
+	for (int i = 0; mask; mask &= mask - 1, i++) {
+		out |= ((x >> __builtin_ctzll(mask)) & 1) << i;
+	}
+	return out;
+#endif
+}
+
+// Stores popcount(q & v[j]) in out[j] for j < n.
+//
+// Uses VPOPCNTQ on 8 words at a time where AVX-512 VPOPCNTDQ is available,
+// otherwise a nibble lookup table over 4 words at a time with AVX2, and
+// the scalar popcount instruction for whatever is left.
+inline void andPopcounts(uint64_t q, const uint64_t *v, size_t n, uint32_t *out) {
+	size_t j = 0;
+
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+	__m512i q8 = _mm512_set1_epi64((long long)q);
+	for (; j + 8 <= n; j += 8) {
+		__m512i x = _mm512_and_si512(q8, _mm512_loadu_si512((const void*)(v + j)));
+		__m512i c = _mm512_popcnt_epi64(x);
+		_mm256_storeu_si256((__m256i*)(out + j), _mm512_maskz_cvtepi64_epi32(0xff, c));
+	}
+#elif defined(__AVX2__)
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i q4 = _mm256_set1_epi64x((long long)q);
+	for (; j + 4 <= n; j += 4) {
+		__m256i x = _mm256_and_si256(q4, _mm256_loadu_si256((const __m256i*)(v + j)));
+		__m256i lo = _mm256_and_si256(x, low);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low);
+		__m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+		__m256i c = _mm256_sad_epu8(bytes, _mm256_setzero_si256());  // one sum per 64-bit lane.
+		// Pick the low 32 bits of each lane.
+		__m256i packed = _mm256_permutevar8x32_epi32(c, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+		_mm_storeu_si128((__m128i*)(out + j), _mm256_castsi256_si128(packed));
+	}
+#endif
+
+	for (; j < n; j++) {
+		out[j] = (uint32_t)__builtin_popcountll(q & v[j]);
+	}
+}
+
+// Returns the number of bits set in both q and v, which have Words words each.
+// Words is a compile-time constant, so the loops below are fully unrolled.
+template <int Words>
+inline uint32_t andPopcount(const uint64_t *q, const uint64_t *v) {
+	uint32_t count = 0;
+	int j = 0;
+
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+	if (Words >= 8) {
+		__m512i sum = _mm512_setzero_si512();
+		for (; j + 8 <= Words; j += 8) {
+			__m512i x = _mm512_and_si512(_mm512_loadu_si512((const void*)(q + j)), _mm512_loadu_si512((const void*)(v + j)));
+			sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+		}
+		uint64_t lanes[8];
+		_mm512_storeu_si512((void*)lanes, sum);
+		for (int i = 0; i < 8; i++) {
+			count += (uint32_t)lanes[i];
+		}
+	}
+#endif
+
+	for (; j < Words; j++) {
+		count += (uint32_t)__builtin_popcountll(q[j] & v[j]);
+	}
+	return count;
+}
+
+};
+
+#endif  // SLASH_POPCOUNT_H
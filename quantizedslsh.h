@@ -0,0 +1,309 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_QUANTIZEDSLSH_H
+#define SLASH_QUANTIZEDSLSH_H
+
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "dot.h"
+#include "math.h"
+#include "slsh.h"
+#include "types.h"
+#include "mappedfile.h"
+
+namespace slash {
+
+// Class QuantizedSLSH hashes like SLSH, giving the very same hashes, while
+// reading a quarter of the memory: the rotations are kept as int8 with a
+// scale per row, and the vertex is chosen on the quantized dot products.
+//
+// A dot product with a quantized row is off from the exact one by at most
+// the lesser of half the scale of the row times the L1 norm of the point,
+// and the norm of the quantization error of the row times the Euclidean
+// norm of the point, plus rounding.
+// Rows whose quantized score cannot be told apart from the best score
+// within these bounds are rescored with the exact rotations of an SLSH,
+// which the hasher keeps for that purpose. Any other row is certainly not
+// the one SLSH would pick, so the result does not change. Hash and
+// HashBatch can count how often the exact rows had to be read.
+//
+// HashProbes ranks alternatives by the exact scores of all vertices, so it
+// is left to the exact rotations.
+//
+// FeatureVector must provide Unpack(float *x), storing its d coordinates in x.
+template <class FeatureVector>
+class QuantizedSLSH {
+	// Number of floats of scratch space Hash keeps on the stack.
+	static const int MaxStackFloats = 4096;
+
+	SLSH<FeatureVector> *exact;
+	// Row r of rotation m, quantized, starts at rows + (m*d + r)*stride, and
+	// is multiplied by scales[m*d + r] to get back to the exact row.
+	int8_t *rows;
+	float *scales;
+	float *errors;  // errors[i] bounds the Euclidean norm of exact row i minus its quantized form.
+	size_t stride;  // row stride in bytes; d padded up to a cache line.
+	unsigned int hbits;
+	int d, k, l;
+
+	QuantizedSLSH(const QuantizedSLSH&) = delete;
+	QuantizedSLSH &operator=(const QuantizedSLSH&) = delete;
+
+	// Layout of the head of a QuantizedSLSH written by Write, followed by the
+	// exact SLSH. The quantized rows are recomputed by Map.
+	struct header {
+		char magic[4];
+		uint32_t pad;
+	};
+
+	// Takes ownership of exact and quantizes its rotations.
+	explicit QuantizedSLSH(SLSH<FeatureVector> *exact) : exact(exact) {
+		this->d = exact->D();
+		this->k = exact->K();
+		this->l = exact->L();
+		this->hbits = (unsigned int)ceil(log2(2.0*this->d));
+		this->stride = alignedSize(this->d);
+
+		size_t nrows = (size_t)this->k*this->l*this->d;
+		this->rows = alignedBytes(nrows*this->stride);
+		this->scales = alignedFloats(nrows);
+		this->errors = alignedFloats(nrows);
+		for (int m=0; m<this->k*this->l; m++) {
+			for (int r=0; r<this->d; r++) {
+				const float *row = exact->Row(m, r);
+				size_t i = (size_t)m*this->d + r;
+				float max = 0;
+				for (int j=0; j<this->d; j++) {
+					max = std::max(max, fabsf(row[j]));
+				}
+				float scale = max > 0 ? max/127 : 1;
+				int8_t *q = this->rows + i*this->stride;
+				double error = 0;
+				for (int j=0; j<this->d; j++) {
+					q[j] = (int8_t)lrintf(row[j]/scale);
+					double e = (double)row[j] - (double)scale*q[j];
+					error += e*e;
+				}
+				this->scales[i] = scale;
+				this->errors[i] = (float)(sqrt(error)*(1 + 1e-6));
+			}
+		}
+	}
+
+	// Returns the vertex SLSH picks for rotation m, given the coordinates x of
+	// p padded with zeros to stride floats, their L1 and L2 norms, and 2d
+	// floats of scratch space in dots.
+	int argmaxi(const FeatureVector &p, const float *x, float l1, float l2, int m, float *dots, uint64_t *rechecks) const {
+		const int8_t *q = this->rows + (size_t)m*this->d*this->stride;
+		const float *s = this->scales + (size_t)m*this->d;
+		const float *e = this->errors + (size_t)m*this->d;
+		float *bounds = dots + this->d;
+		// Rounding of both float sums, per unit of scale.
+		const float rounding = 2*127*(float)this->stride*FLT_EPSILON;
+
+		// bounds[r] bounds |exact - quantized| for row r; low is the least
+		// score the best row can have.
+		float low = -1;
+		for (int r=0; r<this->d; r++) {
+			float dot = s[r]*dotInt8(x, q + (size_t)r*this->stride, this->stride);
+			dots[r] = dot;
+			bounds[r] = std::min(0.5f*l1*s[r], l2*e[r]) + l1*s[r]*rounding;
+			low = std::max(low, fabsf(dot) - bounds[r]);
+		}
+
+		int candidates = 0, last = 0;
+		for (int r=0; r<this->d && candidates < 2; r++) {
+			if (fabsf(dots[r]) + bounds[r] >= low) {
+				candidates++;
+				last = r;
+			}
+		}
+		// A single candidate set low itself, so with low > 0 its sign is right too.
+		if (candidates == 1 && low > 0) {
+			return dots[last] >= 0 ? last : last + this->d;
+		}
+
+		// Rescore the candidates exactly, with the rule of SLSH::argmaxi.
+		(*rechecks)++;
+		int maxi = 0;
+		float max = 0;
+		for (int r=0; r<this->d; r++) {
+			if (fabsf(dots[r]) + bounds[r] < low) {
+				continue;
+			}
+			float dot = p.Dot(this->exact->Row(m, r));
+			float abs = dot>=0?dot:-dot;
+			if (abs < max) {
+				continue;
+			}
+			max = abs;
+			maxi = dot >= 0 ? r : r + this->d;
+		}
+		return maxi;
+	}
+
+	// Hashes p into g using stride + 2d floats of scratch space, or only
+	// table i if i >= 0.
+	void hash(const FeatureVector &p, float *scratch, HashType *g, uint64_t *rechecks, int i = -1) const {
+		float *x = scratch, *dots = scratch + this->stride;
+		memset(x, 0, this->stride*sizeof(float));
+		p.Unpack(x);
+		float l1 = 0, l2 = 0;
+		for (int j=0; j<this->d; j++) {
+			l1 += fabsf(x[j]);
+			l2 += x[j]*x[j];
+		}
+		// Rounded up, so that they stay bounds.
+		l1 *= 1 + 2*(float)this->d*FLT_EPSILON;
+		l2 = sqrtf(l2)*(1 + 2*(float)this->d*FLT_EPSILON);
+
+		int first = i >= 0 ? i : 0, last = i >= 0 ? i + 1 : this->l;
+		for (i=first; i<last; i++) {
+			HashType h = 0;
+			for (int j=0; j<this->k; j++) {
+				int m = i*this->k + j;
+				h |= (HashType)this->argmaxi(p, x, l1, l2, m, dots, rechecks) << (HashType)(this->hbits*j);
+			}
+			g[i - first] = h;
+		}
+	}
+
+public:
+	QuantizedSLSH(int d, int k, int L) : QuantizedSLSH(new SLSH<FeatureVector>(d, k, L)) {
+	}
+
+	QuantizedSLSH(int d, int k, int L, uint64_t seed) : QuantizedSLSH(new SLSH<FeatureVector>(d, k, L, seed)) {
+	}
+
+	static int MaxK(int d) {
+		return SLSH<FeatureVector>::MaxK(d);
+	}
+
+	inline int D() const {
+		return this->d;
+	}
+
+	// Returns k, after chopping it down to MaxK.
+	inline int K() const {
+		return this->k;
+	}
+
+	inline int L() const {
+		return this->l;
+	}
+
+	// Hashes a single point l times, storing the result in g. Same as SLSH::Hash.
+	void Hash(const FeatureVector &p, HashType *g) const {
+		uint64_t rechecks = 0;
+		this->Hash(p, g, &rechecks);
+	}
+
+	// Same as above, adding to rechecks the number of the k*l elementary
+	// hashes that read exact rows.
+	void Hash(const FeatureVector &p, HashType *g, uint64_t *rechecks) const {
+		float stack[MaxStackFloats];
+		std::vector<float> heap;
+		float *scratch = stack;
+		if (this->stride + 2*this->d > MaxStackFloats) {
+			heap.resize(this->stride + 2*this->d);
+			scratch = heap.data();
+		}
+		this->hash(p, scratch, g, rechecks);
+	}
+
+	// Returns the hash of p in table i alone, g[i] of Hash(p, g).
+	HashType HashTable(const FeatureVector &p, int i) const {
+		float stack[MaxStackFloats];
+		std::vector<float> heap;
+		float *scratch = stack;
+		if (this->stride + 2*this->d > MaxStackFloats) {
+			heap.resize(this->stride + 2*this->d);
+			scratch = heap.data();
+		}
+		HashType g;
+		uint64_t rechecks = 0;
+		this->hash(p, scratch, &g, &rechecks, i);
+		return g;
+	}
+
+	// Hashes n points, storing l consecutive hashes per point in g (n*l in total).
+	void HashBatch(const FeatureVector *points, size_t n, HashType *g) const {
+		uint64_t rechecks = 0;
+		this->HashBatch(points, n, g, &rechecks);
+	}
+
+	// Same as above, adding to rechecks the number of the n*k*l elementary
+	// hashes that read exact rows.
+	void HashBatch(const FeatureVector *points, size_t n, HashType *g, uint64_t *rechecks) const {
+		std::vector<float> scratch(this->stride + 2*this->d);
+		for (size_t j=0; j<n; j++) {
+			this->hash(points[j], scratch.data(), g + j*this->l, rechecks);
+		}
+	}
+
+	// Same as SLSH::HashProbes, on the exact rotations.
+	void HashProbes(const FeatureVector &p, int probes, HashType *g) const {
+		this->exact->HashProbes(p, probes, g);
+	}
+
+	// Returns the exact hasher, which hashes identically.
+	const SLSH<FeatureVector> &Exact() const {
+		return *this->exact;
+	}
+
+	// Memory used by the quantized rotations in bytes. The exact rotations
+	// take another Exact().Bytes(), but are only read on rechecks.
+	size_t Bytes() const {
+		size_t nrows = (size_t)this->k*this->l*this->d;
+		return nrows*(this->stride + 2*sizeof(float));
+	}
+
+	// Appends the exact rotations to an index file. Returns false on error.
+	bool Write(FILE *f) const {
+		header h = {{'Q', 'S', 'L', 'H'}, 0};
+		return writeAligned(f, &h, sizeof(h)) && this->exact->Write(f);
+	}
+
+	// Returns a QuantizedSLSH that rescores with the exact rotations written
+	// by Write at data, see SLSH::Map. Returns nullptr if data is malformed.
+	static QuantizedSLSH *Map(const char *data, size_t size) {
+		size_t at = alignedSize(sizeof(header));
+		if (size < at || memcmp(data, "QSLH", 4) != 0) {
+			return nullptr;
+		}
+		SLSH<FeatureVector> *exact = SLSH<FeatureVector>::Map(data + at, size - at);
+		if (exact == nullptr) {
+			return nullptr;
+		}
+		return new QuantizedSLSH(exact);
+	}
+
+	~QuantizedSLSH() {
+		delete this->exact;
+		freeAligned(this->rows);
+		freeAligned(this->scales);
+		freeAligned(this->errors);
+	}
+};
+
+};
+
+#endif  // SLASH_QUANTIZEDSLSH_H
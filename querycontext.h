@@ -17,108 +17,178 @@
 #ifndef SLASH_QUERYCONTEXT_H
 #define SLASH_QUERYCONTEXT_H
 
+#include <algorithm>
 #include <vector>
 #include <stdlib.h>
 #include "float.h"
+#include "types.h"
 
 namespace slash {
 
-// Max-similarity search context
-template <class FeatureVector>
+// A point found by a query and its similarity to the query point.
+struct Neighbor {
+	PointID id;
+	float similarity;
+
+	inline bool operator==(const Neighbor &n) const {
+		return this->id == n.id && this->similarity == n.similarity;
+	}
+};
+
+// Max-similarity search context.
+//
+// Keeps the best neighbors seen so far in a min-heap bounded by limit, so that
+// the least similar one can be replaced in O(log limit). It also remembers
+// which points were visited during the current query, using an array of
+// epoch stamps indexed by id: a point found in several tables is scored only
+// once, and starting a new query is O(1) rather than clearing the array.
+// A context can be reused for any number of queries through Reset.
 class QueryContext {
-	float curmin;
-	size_t curminIndex;
-	std::vector<FeatureVector> neighbors;
-	std::vector<float> similarities;
-	std::vector<int> ncopies;
+	std::vector<Neighbor> heap;  // min-heap on similarity; heap[0] is the least similar neighbor.
+	std::vector<int> ncopies;    // ncopies[i] is the number of copies of heap[i].
+	std::vector<uint32_t> stamps;  // stamps[id] == epoch iff id was visited in the current query.
+	uint32_t epoch;
 	int limit;
 	int found;
-	int uniques;
-	
-	inline void updateMin() {
-		float curmin = FLT_MAX;
-		size_t curminIndex = -1;
-		for (int i=0; i<this->uniques; i++) {
-			float s = this->similarities[i];
-			if (s < curmin) {
-				curmin = s;
-				curminIndex = i;
+	size_t replacements;  // neighbors replaced by a more similar one since Reset.
+
+	inline void swap(size_t i, size_t j) {
+		Neighbor n = this->heap[i];
+		this->heap[i] = this->heap[j];
+		this->heap[j] = n;
+		int c = this->ncopies[i];
+		this->ncopies[i] = this->ncopies[j];
+		this->ncopies[j] = c;
+	}
+
+	inline void siftUp(size_t i) {
+		while (i > 0) {
+			size_t parent = (i-1)/2;
+			if (!(this->heap[i].similarity < this->heap[parent].similarity)) {
+				break;
+			}
+			this->swap(i, parent);
+			i = parent;
+		}
+	}
+
+	inline void siftDown(size_t i) {
+		size_t size = this->heap.size();
+		for (;;) {
+			size_t min = i, left = 2*i+1, right = 2*i+2;
+			if (left < size && this->heap[left].similarity < this->heap[min].similarity) {
+				min = left;
+			}
+			if (right < size && this->heap[right].similarity < this->heap[min].similarity) {
+				min = right;
 			}
+			if (min == i) {
+				break;
+			}
+			this->swap(i, min);
+			i = min;
 		}
-		this->curmin = curmin;
-		this->curminIndex = curminIndex;
 	}
 	
 public:
-	inline void Insert(const FeatureVector &q, float s, int n) {
-		if (n <= 0) {
+	// Records a neighbor id with similarity s and n copies. Neighbors are kept
+	// until their copies add up to limit; after that a new one replaces the
+	// least similar neighbor if it is more similar.
+	// With a limit of 0 nothing is kept.
+	inline void Insert(PointID id, float s, int n) {
+		if (n <= 0 || this->limit <= 0) {
 			return;
 		}
 
-		if (this->found >= this->limit && s <= this->curmin) {
-			return;
-		}
-		
+		Neighbor neighbor = {id, s};
 		if (this->found < this->limit) {
-			this->neighbors.push_back(q);
-			this->similarities.push_back(s);
+			this->heap.push_back(neighbor);
 			this->ncopies.push_back(n);
 			this->found += n;
-			this->uniques++;
-			
-			if (this->uniques == this->limit) {
-				this->updateMin();
-			}
+			this->siftUp(this->heap.size()-1);
 			return;
 		}
-		
-		this->found -= this->ncopies[this->curminIndex];
-		
-		this->neighbors[this->curminIndex] = q;
-		this->similarities[this->curminIndex] = s;
-		this->ncopies[this->curminIndex] = n;
-		this->found += n;
-		this->updateMin();
+
+		if (s <= this->heap[0].similarity) {
+			return;
+		}
+
+		this->found += n - this->ncopies[0];
+		this->replacements++;
+		this->heap[0] = neighbor;
+		this->ncopies[0] = n;
+		this->siftDown(0);
 	}
-	
-	inline std::vector<FeatureVector> Neighbors() {
-		return this->neighbors;
+
+	// Marks id as visited in the current query. Returns false if it already was.
+	// id must be less than the number of points given to Reset.
+	inline bool Visit(PointID id) {
+		if (this->stamps[id] == this->epoch) {
+			return false;
+		}
+		this->stamps[id] = this->epoch;
+		return true;
+	}
+
+	// Returns the neighbors, most similar first.
+	inline std::vector<Neighbor> Neighbors() const {
+		std::vector<Neighbor> neighbors(this->heap.size());
+		this->CopyNeighbors(neighbors.data());
+		return neighbors;
+	}
+
+	// Stores the neighbors in out, most similar first, and returns their
+	// number, at most the limit given to Reset.
+	inline int CopyNeighbors(Neighbor *out) const {
+		std::copy(this->heap.begin(), this->heap.end(), out);
+		std::sort(out, out + this->heap.size(), [](const Neighbor &a, const Neighbor &b) {
+			return a.similarity > b.similarity;
+		});
+		return (int)this->heap.size();
 	}
 	
-	inline int Limit() {
+	inline int Limit() const {
 		return this->limit;
 	}
 
-	// Used internally by LSH::Query. Don't use.
-	// Removes the most similar item in a quick & dirty way.
-	// Assumes that there will be no further operations other than Neighbors.
- 	inline void shrink() {
-		float curmax = -FLT_MAX;
-		size_t curmaxIndex = -1;
-		for (int i=0; i<this->uniques; i++) {
-			float s = this->similarities[i];
-			if (s > curmax) {
-				curmax = s;
-				curmaxIndex = i;
-			}
+	// Returns the number of neighbors kept, what CopyNeighbors stores.
+	inline size_t Size() const {
+		return this->heap.size();
+	}
+
+	// Returns the number of neighbors Insert replaced since Reset.
+	inline size_t Replacements() const {
+		return this->replacements;
+	}
+
+	// Starts a new query with the given limit over points with ids less than
+	// nPoints, keeping allocated memory.
+	void Reset(int limit, size_t nPoints) {
+		this->limit = limit;
+		this->found = 0;
+		this->replacements = 0;
+		this->heap.clear();
+		this->ncopies.clear();
+		if (limit > 0) {
+			this->heap.reserve(limit);
+			this->ncopies.reserve(limit);
 		}
 
-		if(this->ncopies[curmaxIndex]-1 > 0) {
-			return;
+		if (this->stamps.size() < nPoints) {
+			this->stamps.resize(nPoints, 0);
+		}
+		this->epoch++;
+		if (this->epoch == 0) {
+			std::fill(this->stamps.begin(), this->stamps.end(), 0);
+			this->epoch = 1;
 		}
+	}
 
-		this->neighbors[curmaxIndex] = this->neighbors.back();
-		this->neighbors.pop_back();
+	QueryContext() : epoch(0), limit(0), found(0), replacements(0) {
 	}
-	
-	explicit QueryContext(int limit) {
-		this->limit = limit;
-		this->neighbors.reserve(limit);
-		this->similarities.reserve(limit);
-		this->ncopies.reserve(limit);
-		this->curmin = FLT_MAX;
-		this->found = 0;
-		this->uniques = 0;
+
+	explicit QueryContext(int limit) : epoch(0), limit(0), found(0), replacements(0) {
+		this->Reset(limit, 0);
 	}
 };
 
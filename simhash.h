@@ -0,0 +1,224 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_SIMHASH_H
+#define SLASH_SIMHASH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "math.h"
+#include "multiprobe.h"
+#include "types.h"
+#include "mappedfile.h"
+
+namespace slash {
+
+// Class SimHash hashes with random hyperplanes: an elementary hash is the
+// side of a random hyperplane through the origin the point lies on, so two
+// points at angle t collide on it with probability 1 - t/pi.
+// ``Charikar, M. S., 2002. Similarity Estimation Techniques from Rounding
+// Algorithms. STOC''.
+//
+// An elementary hash is one bit, and the k bits of a table are packed
+// directly into the hash. It costs one dot product, against d for SLSH,
+// but separates points less: for the same selectivity k has to be about
+// log2(2d) times larger, so hashing is O(kLd) with that larger k.
+//
+// FeatureVector only needs Dot, like for SLSH.
+template <class FeatureVector>
+class SimHash {
+	// The normals of all k*l hyperplanes. The normal of hyperplane m starts
+	// at planes + m*stride. The planes are either ownedPlanes or a view into
+	// a mapped index file.
+	const float *planes;
+	float *ownedPlanes;
+	size_t stride;  // d padded up to a cache line.
+	int d;       // the dimension of the feature space.
+	int k;       // number of hyperplanes per table.
+	int l;       // number of tables.
+
+	SimHash(const SimHash&) = delete;
+	SimHash &operator=(const SimHash&) = delete;
+
+	// Layout of the head of a SimHash written by Write.
+	struct header {
+		char magic[4];
+		uint32_t d;
+		uint32_t k;
+		uint32_t l;
+		uint64_t stride;
+	};
+
+	SimHash() : planes(nullptr), ownedPlanes(nullptr) {
+	}
+
+	inline const float *plane(int m) const {
+		return this->planes + (size_t)m*this->stride;
+	}
+
+public:
+	// Draws the hyperplanes with a seed from rand.
+	SimHash(int d, int k, int L) : SimHash(d, k, L, randomSeed()) {
+	}
+
+	// Hyperplane m is drawn from stream m of seed, so the hasher depends on
+	// d, k, L and seed only. The normals are scaled to unit length, which
+	// leaves the hashes alone but makes |p.Dot(normal)| the distance of p to
+	// the hyperplane, for HashProbes.
+	SimHash(int d, int k, int L, uint64_t seed) : d(d), k(k), l(L) {
+		int kmax = MaxK(d);
+		if (k > kmax) {
+			this->k = kmax;
+			printf("k is too big, chopping down (%d->%d)\n", k, kmax);
+		}
+
+		this->stride = paddedFloats(d);
+		size_t nplanes = (size_t)this->k*this->l;
+		this->ownedPlanes = alignedFloats(nplanes*this->stride);
+		this->planes = this->ownedPlanes;
+		for (size_t m=0; m<nplanes; m++) {
+			counterRng r(seed, m);
+			float *v = this->ownedPlanes + m*this->stride;
+			double norm = 0;
+			for (int i=0; i<d; i++) {
+				double x = r.Normal();
+				v[i] = (float)x;
+				norm += x*x;
+			}
+			norm = sqrt(norm);
+			for (int i=0; i<d; i++) {
+				v[i] = (float)(v[i]/norm);
+			}
+		}
+	}
+
+	// Returns the largest k for which a hash fits in a HashType, one bit per
+	// elementary hash.
+	static int MaxK(int) {
+		return (int)HashBits;
+	}
+
+	inline int D() const {
+		return this->d;
+	}
+
+	// Returns k, after chopping it down to MaxK.
+	inline int K() const {
+		return this->k;
+	}
+
+	inline int L() const {
+		return this->l;
+	}
+
+	// Hashes a single point l times, storing the result in g.
+	void Hash(const FeatureVector &p, HashType *g) const {
+		for (int i=0; i<this->l; i++) {
+			g[i] = this->HashTable(p, i);
+		}
+	}
+
+	// Returns the hash of p in table i alone, g[i] of Hash(p, g).
+	HashType HashTable(const FeatureVector &p, int i) const {
+		HashType h = 0;
+		for (int j=0; j<this->k; j++) {
+			h |= (HashType)(p.Dot(this->plane(i*this->k + j)) >= 0) << j;
+		}
+		return h;
+	}
+
+	// Hashes n points, storing l consecutive hashes per point in g (n*l in total).
+	void HashBatch(const FeatureVector *points, size_t n, HashType *g) const {
+		for (size_t j=0; j<n; j++) {
+			this->Hash(points[j], g + j*this->l);
+		}
+	}
+
+	// Hashes p like Hash, and additionally computes probes-1 alternative
+	// hashes for each table, laid out like in SLSH::HashProbes. An
+	// alternative flips the bits of some hyperplanes, those p lies closest
+	// to first: the gap of a flip is the distance to the hyperplane, as the
+	// normals are unit vectors.
+	void HashProbes(const FeatureVector &p, int probes, HashType *g) const {
+		std::vector<perturbation> ps;
+		int m = 0;
+		for (int i=0; i<this->l; i++) {
+			HashType *gi = g + (size_t)i*probes;
+			gi[0] = 0;
+			ps.clear();
+			for (int j=0; j<this->k; j++, m++) {
+				float dot = p.Dot(this->plane(m));
+				int bit = dot >= 0;
+				gi[0] |= (HashType)bit << j;
+				perturbation q = {dot>=0?dot:-dot, j, 1 - bit};
+				ps.push_back(q);
+			}
+			std::sort(ps.begin(), ps.end());
+			enumerateProbes(ps, probes - 1, 1, gi[0], gi + 1);
+		}
+	}
+
+	// Memory used by the hyperplanes in bytes.
+	size_t Bytes() const {
+		return (size_t)this->k*this->l*this->stride*sizeof(float);
+	}
+
+	// Appends the parameters and the hyperplanes to an index file.
+	// Returns false on error.
+	bool Write(FILE *f) const {
+		header h = {{'S', 'I', 'M', 'H'}, (uint32_t)this->d, (uint32_t)this->k, (uint32_t)this->l, this->stride};
+		return writeAligned(f, &h, sizeof(h)) && writeAligned(f, this->planes, this->Bytes());
+	}
+
+	// Returns a SimHash that hashes with the hyperplanes written by Write at
+	// data, which has size bytes available, without copying them. data must
+	// be cache line aligned and outlive the SimHash. Returns nullptr if data
+	// is malformed.
+	static SimHash *Map(const char *data, size_t size) {
+		if (size < sizeof(header)) {
+			return nullptr;
+		}
+		header h;
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, "SIMH", 4) != 0 || h.d == 0 || h.d > INT32_MAX || h.l > INT32_MAX ||
+			h.stride != paddedFloats(h.d) || h.k > HashBits) {
+			return nullptr;
+		}
+		size_t at = alignedSize(sizeof(header)), n;
+		if (__builtin_mul_overflow((size_t)h.k*h.l, (size_t)h.stride, &n) || !nextBlock(&at, n, sizeof(float), size)) {
+			return nullptr;
+		}
+
+		SimHash *sh = new SimHash();
+		sh->d = h.d;
+		sh->k = h.k;
+		sh->l = h.l;
+		sh->stride = h.stride;
+		sh->planes = (const float*)(data + alignedSize(sizeof(header)));
+		return sh;
+	}
+
+	~SimHash() {
+		freeAligned(this->ownedPlanes);
+	}
+};
+
+};
+
+#endif  // SLASH_SIMHASH_H
@@ -17,9 +17,18 @@
 #ifndef SLASH_SLSH_H
 #define SLASH_SLSH_H
 
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
 #include "math.h"
+#include "multiprobe.h"
+#include "parallel.h"
+#include "popcount.h"
 #include "hash.h"
 #include "types.h"
+#include "mappedfile.h"
 
 
 namespace slash {
@@ -31,43 +40,267 @@ namespace slash {
 // SLSH is equivalent to an ε-nearest neighbor search using cosine similarity, and does not suffer from the curse of dimensionality.
 template <class FeatureVector>
 class SLSH {
-	std::vector<std::vector<dvector> > vAll; // vAll[i][j] is the vector $A_i \tilde v_j$ from the article.
+	// All k*l random rotation matrices in one aligned block. Row j of matrix m,
+	// the vector $A_m \tilde v_j$ from the article, starts at panel + (m*d + j)*stride.
+	// The panel is either ownedPanel or a view into a mapped index file.
+	const float *panel;
+	float *ownedPanel;
+	size_t stride;  // row stride in floats; d padded up to a cache line so every row is aligned.
 	unsigned int hbits;     // Ceil(Log2(2*d)).
 	int d;       // the dimension of the feature space.
 	int k;       // number of elementary hash functions (h) to be concataneted to obtain a reliable enough hash function (g). LSH queries becomes more selective with increasing k, due to the reduced the probability of collision.
 	int l;       // number of "copies" of the bins (with a different random matrices). Increasing L will increase the number of points the should be scanned linearly during query.
+
+	// Number of points and rows processed together by HashBatch. A block of
+	// rows (RowBlock*stride floats) stays in L1 while every point in the
+	// block is dotted against it, and the per-point argmax state fits in registers.
+	static const int PointBlock = 8;
+	static const int RowBlock = 4;
+
+	// Same for binary feature vectors (see hashBits): RowTile rows are
+	// transposed into one tile, the 16 lanes of dotBytesTile, and reused by
+	// a block of BitsBlock points. Batches of fewer than MinBits points do
+	// not pay for the transposition and take the hashBlock path. Measured
+	// with 64 to 1024 bit codes: 4 points already hash 3x faster than with
+	// Hash, and blocks of 64 points about 5x.
+	static const int RowTile = 16;
+	static const int BitsBlock = 64;
+	static const int MinBits = 4;
+
+	// Tells binary feature vectors, which provide their bits through Words
+	// and Word(w) like for TableSLSH, from the others.
+	template <class V>
+	struct hasWords {
+		template <class U> static char test(decltype(&U::Words));
+		template <class U> static long test(...);
+		static const bool value = sizeof(test<V>(nullptr)) == 1;
+	};
+
+	SLSH(const SLSH&) = delete;
+	SLSH &operator=(const SLSH&) = delete;
+
+	// Layout of the head of an SLSH written by Write.
+	struct header {
+		char magic[4];
+		uint32_t d;
+		uint32_t k;
+		uint32_t l;
+		uint32_t hbits;
+		uint32_t pad;
+		uint64_t stride;
+	};
+
+	SLSH() : panel(nullptr), ownedPanel(nullptr) {
+	}
+
+	inline const float *matrix(int m) const {
+		return this->panel + (size_t)m*this->d*this->stride;
+	}
+
+	// Hashes n <= PointBlock points against all k*l matrices.
+	// g receives n*l hashes, l consecutive hashes per point.
+	void hashBlock(const FeatureVector *points, int n, HashType *g) const {
+		float max[PointBlock];
+		int maxi[PointBlock];
+		float dots[RowBlock][PointBlock];
+
+		for (int j=0; j<n; j++) {
+			for (int i=0; i<this->l; i++) {
+				g[j*this->l + i] = 0;
+			}
+		}
+
+		for (int m=0; m<this->k*this->l; m++) {
+			const float *vs = this->matrix(m);
+			for (int j=0; j<PointBlock; j++) {
+				max[j] = 0;
+				maxi[j] = 0;
+			}
+
+			for (int r0=0; r0<this->d; r0+=RowBlock) {
+				int rn = this->d - r0 < RowBlock ? this->d - r0 : RowBlock;
+				for (int r=0; r<rn; r++) {
+					const float *row = vs + (size_t)(r0+r)*this->stride;
+					for (int j=0; j<n; j++) {
+						dots[r][j] = points[j].Dot(row);
+					}
+				}
+
+				// Same update rule as argmaxi, written branch-free so that
+				// the compiler can vectorize it across the point block.
+				for (int r=0; r<rn; r++) {
+					int i = r0 + r;
+					for (int j=0; j<n; j++) {
+						float dot = dots[r][j];
+						float abs = dot>=0?dot:-dot;
+						bool take = !(abs < max[j]);
+						max[j] = take ? abs : max[j];
+						maxi[j] = take ? (dot >= 0 ? i : i + this->d) : maxi[j];
+					}
+				}
+			}
+
+			int table = m / this->k;
+			int shift = this->hbits * (m % this->k);
+			for (int j=0; j<n; j++) {
+				g[j*this->l + table] |= (HashType)maxi[j] << (HashType)shift;
+			}
+		}
+	}
+
+	// Hashes n <= BitsBlock binary points against all k*l matrices, like
+	// hashBlock. The rows of a matrix are transposed RowTile at a time into
+	// tile, which has 64*Words*RowTile floats, so that every set bit of a
+	// point adds one vector of RowTile floats, and the tile is reused by all
+	// n points. dotBytesTile adds in the same order as dotBytes, so the dot
+	// products are bit for bit those of Dot.
+	void hashBits(const FeatureVector *points, int n, float *tile, HashType *g) const {
+		const int words = FeatureVector::Words;
+		const int cols = 64*words;
+		float max[BitsBlock];
+		int maxi[BitsBlock];
+
+		for (int j=0; j<n; j++) {
+			for (int i=0; i<this->l; i++) {
+				g[j*this->l + i] = 0;
+			}
+		}
+
+		for (int m=0; m<this->k*this->l; m++) {
+			const float *vs = this->matrix(m);
+			for (int j=0; j<n; j++) {
+				max[j] = 0;
+				maxi[j] = 0;
+			}
+
+			for (int r0=0; r0<this->d; r0+=RowTile) {
+				int rn = this->d - r0 < RowTile ? this->d - r0 : RowTile;
+				for (int c=0; c<cols; c++) {
+					for (int t=0; t<RowTile; t++) {
+						bool in = t < rn && (size_t)c < this->stride;
+						tile[c*RowTile + t] = in ? vs[(size_t)(r0+t)*this->stride + c] : 0;
+					}
+				}
+
+				for (int j=0; j<n; j++) {
+					float dots[RowTile];
+					for (int t=0; t<RowTile; t++) {
+						dots[t] = 0;
+					}
+					for (int w=0; w<words; w++) {
+						dotBytesTile(points[j].Word(w), tile + (size_t)64*w*RowTile, dots);
+					}
+
+					// Same update rule as argmaxi, in increasing row order.
+					for (int t=0; t<rn; t++) {
+						float dot = dots[t];
+						float abs = dot>=0?dot:-dot;
+						if (abs < max[j]) {
+							continue;
+						}
+						max[j] = abs;
+						maxi[j] = dot >= 0 ? r0 + t : r0 + t + this->d;
+					}
+				}
+			}
+
+			int table = m / this->k;
+			int shift = this->hbits * (m % this->k);
+			for (int j=0; j<n; j++) {
+				g[j*this->l + table] |= (HashType)maxi[j] << (HashType)shift;
+			}
+		}
+	}
+
+	void hashBatch(const FeatureVector *points, size_t n, HashType *g, std::true_type) const {
+		// Without vector lanes, or for few points, the tile does not pay for
+		// itself.
+#if defined(__AVX2__) || defined(__AVX512F__)
+		if (n >= (size_t)MinBits) {
+			std::vector<float> tile((size_t)64*FeatureVector::Words*RowTile);
+			for (size_t j=0; j<n; j+=BitsBlock) {
+				int bn = n - j < (size_t)BitsBlock ? (int)(n - j) : BitsBlock;
+				this->hashBits(points + j, bn, tile.data(), g + j*this->l);
+			}
+			return;
+		}
+#endif
+		this->hashBatch(points, n, g, std::false_type());
+	}
+
+	void hashBatch(const FeatureVector *points, size_t n, HashType *g, std::false_type) const {
+		for (size_t j=0; j<n; j+=PointBlock) {
+			int bn = n - j < (size_t)PointBlock ? (int)(n - j) : PointBlock;
+			this->hashBlock(points + j, bn, g + j*this->l);
+		}
+	}
+
 public:
-	SLSH(int d, int k, int L) : d(d), k(k), l(L) {
+	// Draws the rotations with a seed from rand.
+	SLSH(int d, int k, int L) : SLSH(d, k, L, randomSeed()) {
+	}
+
+	// Rotation m is drawn from stream m of seed, so the hasher depends on d,
+	// k, L and seed only. The rotations are drawn by threads threads, one
+	// per hardware thread if threads <= 0; that does not change them.
+	SLSH(int d, int k, int L, uint64_t seed, int threads = 0) : d(d), k(k), l(L) {
 		double nvertex = 2.0 * this->d;
 		this->hbits = (unsigned int)ceil(log2(nvertex));
-		int kmax = static_cast<int>(HashBits/this->hbits);
+		int kmax = MaxK(d);
 		if (this->k > kmax) {
 			this->k = kmax;
 			printf("k is too big, chopping down (%d->%d)\n", k, kmax);
 		}
 		
-		rng *r = new rng[d];
-		
 		// For orthoplex, the basis Vectortors v_i are permutations of the Vectortor (1, 0, ..., 0),
 		// and -(1, 0, ..., 0).
 		// Thus R v_i simply picks up the ith row of the rotation matrix, up to a sign.
 		// This means we don't need any matrix multiplication; R matrix is the list of
 		// rotated vectors itself!
-		this->vAll = std::vector<std::vector<dvector> >(this->k*this->l);  // random rotation matrices
-		auto &rotationMatrices = this->vAll;
+		this->stride = paddedFloats(this->d);
+		size_t nmatrices = (size_t)this->k*this->l;
+		this->ownedPanel = alignedFloats(nmatrices*this->d*this->stride);  // random rotation matrices
+		this->panel = this->ownedPanel;
 		
-		for (size_t i=0; i<rotationMatrices.size(); i++) {
-			rotationMatrices[i] = randomRotation(this->d, r);
-		}
-		delete [] r;
+		parallelFor(threadCount(threads), nmatrices, [&](size_t begin, size_t end) {
+			for (size_t m=begin; m<end; m++) {
+				counterRng r(seed, m);
+				randomRotation(this->d, r, this->ownedPanel + m*this->d*this->stride, this->stride);
+			}
+		});
 	}
 	
-	inline int argmaxi(const FeatureVector &p, const std::vector<dvector> &vs) {
+	// Returns the largest k for which the k elementary hashes of a point of
+	// dimension d fit in a HashType. Larger values are chopped down to it.
+	static int MaxK(int d) {
+		return static_cast<int>(HashBits/(unsigned int)ceil(log2(2.0*d)));
+	}
+
+	inline int D() const {
+		return this->d;
+	}
+
+	// Returns k, after chopping it down to MaxK.
+	inline int K() const {
+		return this->k;
+	}
+
+	inline int L() const {
+		return this->l;
+	}
+
+	// Returns row r of rotation m, of d floats. Rotations m*k to m*k+k-1 make
+	// the elementary hashes of table m.
+	inline const float *Row(int m, int r) const {
+		return this->matrix(m) + (size_t)r*this->stride;
+	}
+
+	inline int argmaxi(const FeatureVector &p, const float *vs) const {
 		int maxi = 0;
 		float max = 0;
 
 		for (int i=0; i<this->d; i++) {
-			float dot = p.Dot(vs[i].v);
+			float dot = p.Dot(vs + (size_t)i*this->stride);
 			
 			float abs = dot>=0?dot:-dot;
 			if (abs < max) {
@@ -89,22 +322,117 @@ public:
 	// is required to take the normalization into account.
 	//
 	// The complexity of this function is O(nL)
-	void Hash(const FeatureVector &p, HashType *g) {
-		int ri=0;
-		HashType h;
+	void Hash(const FeatureVector &p, HashType *g) const {
+		for (int i=0; i<this->l; i++) {
+			g[i] = this->HashTable(p, i);
+		}
+	}
+
+	// Returns the hash of p in table i alone, g[i] of Hash(p, g), for
+	// O(kd) dot products instead of O(kLd).
+	HashType HashTable(const FeatureVector &p, int i) const {
+		HashType g = 0;
+		for (int j=0; j<this->k; j++) {
+			HashType h = (HashType)this->argmaxi(p, this->matrix(i*this->k + j)); // See the comment in init.
+			g |= h << (HashType)(this->hbits*j);
+		}
+		return g;
+	}
+
+	// Hashes n points, storing l consecutive hashes per point in g (n*l in total).
+	// Gives the same result as calling Hash on each point, but walks the rotation
+	// panel once per block of points rather than once per point. Binary
+	// feature vectors are dotted with a tile of rows at a time, see hashBits.
+	void HashBatch(const FeatureVector *points, size_t n, HashType *g) const {
+		this->hashBatch(points, n, g, std::integral_constant<bool, hasWords<FeatureVector>::value>());
+	}
+
+	// Hashes p like Hash, and additionally computes probes-1 alternative
+	// hashes for each table. g receives probes hashes per table: g[i*probes]
+	// is the hash of table i and g[i*probes + t] its t-th alternative.
+	//
+	// An alternative replaces the vertices chosen by some of the k elementary
+	// hashes with runner-up vertices. Vertex r (r+d) scores the dot product
+	// of p and row r (its negation), and the distance of an alternative is
+	// the sum of the score gaps to the chosen vertices. Alternatives come in
+	// order of increasing distance (see multiprobe.h).
+	void HashProbes(const FeatureVector &p, int probes, HashType *g) const {
+		std::vector<float> dots(this->d);
+		std::vector<perturbation> ps;
+		int keep = probes - 1;  // no more runner-ups of a single elementary hash can be used.
 
 		for (int i=0; i<this->l; i++) {
-			g[i] = 0;
+			HashType *gi = g + (size_t)i*probes;
+			gi[0] = 0;
+			ps.clear();
+
 			for (int j=0; j<this->k; j++) {
-				auto &vs = this->vAll[ri]; // See the comment in init.
-				h = (HashType)this->argmaxi(p,vs);
-				g[i] |= h << (HashType)(this->hbits*j);
-				ri++;
+				const float *vs = this->matrix(i*this->k + j);
+				int maxi = 0;
+				float max = 0;
+				for (int r=0; r<this->d; r++) {
+					float dot = p.Dot(vs + (size_t)r*this->stride);
+					dots[r] = dot;
+					float abs = dot>=0?dot:-dot;
+					if (abs < max) {
+						continue;
+					}
+					max = abs;
+					maxi = dot >= 0 ? r : r + this->d;
+				}
+				gi[0] |= (HashType)maxi << (HashType)(this->hbits*j);
+				addPerturbations(dots.data(), this->d, j, maxi, max, keep, ps);
 			}
+
+			std::sort(ps.begin(), ps.end());
+			enumerateProbes(ps, keep, this->hbits, gi[0], gi + 1);
 		}
 	}
 
+	// Memory used by the rotations in bytes.
+	size_t Bytes() const {
+		return (size_t)this->k*this->l*this->d*this->stride*sizeof(float);
+	}
+
+	// Appends the parameters and the rotation panel to an index file.
+	// Returns false on error.
+	bool Write(FILE *f) const {
+		header h = {{'S', 'L', 'S', 'H'}, (uint32_t)this->d, (uint32_t)this->k, (uint32_t)this->l, this->hbits, 0, this->stride};
+		size_t n = (size_t)this->k*this->l*this->d*this->stride;
+		return writeAligned(f, &h, sizeof(h)) && writeAligned(f, this->panel, n*sizeof(float));
+	}
+
+	// Returns an SLSH that hashes with the panel written by Write at data,
+	// which has size bytes available, without copying it. data must be cache
+	// line aligned and outlive the SLSH. Returns nullptr if data is malformed.
+	static SLSH *Map(const char *data, size_t size) {
+		if (size < sizeof(header)) {
+			return nullptr;
+		}
+		header h;
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, "SLSH", 4) != 0 || h.d == 0 || h.d > INT32_MAX || h.l > INT32_MAX ||
+			h.stride != paddedFloats(h.d) || h.hbits != (uint32_t)ceil(log2(2.0*h.d)) ||
+			(uint64_t)h.k*h.hbits > HashBits) {
+			return nullptr;
+		}
+		size_t at = alignedSize(sizeof(header)), n;
+		if (__builtin_mul_overflow((size_t)h.k*h.l, (size_t)h.d*h.stride, &n) || !nextBlock(&at, n, sizeof(float), size)) {
+			return nullptr;
+		}
+
+		SLSH *slsh = new SLSH();
+		slsh->d = h.d;
+		slsh->k = h.k;
+		slsh->l = h.l;
+		slsh->hbits = h.hbits;
+		slsh->stride = h.stride;
+		slsh->panel = (const float*)(data + alignedSize(sizeof(header)));
+		return slsh;
+	}
+
 	~SLSH() {
+		freeAligned(this->ownedPanel);
 	}
 };
 
@@ -0,0 +1,115 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_STATS_H
+#define SLASH_STATS_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+#include "types.h"
+
+namespace slash {
+
+// Counters of the work done by queries. Query adds to them, so one QueryStats
+// can sum up any number of queries.
+struct QueryStats {
+	size_t buckets;  // buckets probed, empty or not.
+	size_t candidates;  // ids in the buckets probed: the size of the linear search.
+	size_t duplicates;  // candidates skipped for being in an earlier bucket too.
+	size_t evaluations;  // similarities computed.
+	size_t replacements;  // neighbors pushed out of a full result set by a better one.
+
+	QueryStats() : buckets(0), candidates(0), duplicates(0), evaluations(0), replacements(0) {
+	}
+
+	QueryStats &operator+=(const QueryStats &s) {
+		this->buckets += s.buckets;
+		this->candidates += s.candidates;
+		this->duplicates += s.duplicates;
+		this->evaluations += s.evaluations;
+		this->replacements += s.replacements;
+		return *this;
+	}
+};
+
+// A bucket of a table: the hash and the number of ids hashed to it.
+struct Bucket {
+	HashType hash;
+	size_t size;
+};
+
+// Shape of one table of an index.
+struct TableStats {
+	size_t points;  // ids in the table.
+	size_t buckets;  // non-empty buckets.
+	size_t splits;  // buckets split into smaller ones, see LSH::SetSplit.
+	size_t bytes;  // memory used by the table.
+	std::vector<size_t> histogram;  // histogram[b] buckets have between 2^b and 2^(b+1)-1 ids.
+	std::vector<Bucket> largest;  // the largest buckets, largest first.
+
+	TableStats() : points(0), buckets(0), splits(0), bytes(0) {
+	}
+
+	// Counts a bucket, keeping the largest of them up to a total of keep.
+	void Add(HashType h, size_t size, size_t keep) {
+		int b = 0;
+		while (((size_t)2 << b) <= size) {
+			b++;
+		}
+		if (this->histogram.size() <= (size_t)b) {
+			this->histogram.resize(b+1);
+		}
+		this->histogram[b]++;
+		this->points += size;
+		this->buckets++;
+
+		// largest is a min-heap on size until Finish.
+		auto bySize = [](const Bucket &a, const Bucket &c) { return a.size > c.size; };
+		Bucket bucket = {h, size};
+		if (this->largest.size() < keep) {
+			this->largest.push_back(bucket);
+			std::push_heap(this->largest.begin(), this->largest.end(), bySize);
+		} else if (keep > 0 && size > this->largest[0].size) {
+			std::pop_heap(this->largest.begin(), this->largest.end(), bySize);
+			this->largest.back() = bucket;
+			std::push_heap(this->largest.begin(), this->largest.end(), bySize);
+		}
+	}
+
+	// Sorts largest once all buckets are added.
+	void Finish() {
+		std::sort(this->largest.begin(), this->largest.end(), [](const Bucket &a, const Bucket &c) {
+			return a.size > c.size || (a.size == c.size && a.hash < c.hash);
+		});
+	}
+};
+
+// Shape and memory use of an index.
+struct IndexStats {
+	size_t points;
+	size_t pointBytes;  // memory used by the points and their norms.
+	size_t hashBytes;  // memory used by the hashes of the points, kept for queries by id.
+	size_t binBytes;  // memory used by all tables.
+	std::vector<TableStats> tables;
+
+	IndexStats() : points(0), pointBytes(0), hashBytes(0), binBytes(0) {
+	}
+};
+
+};
+
+#endif  // SLASH_STATS_H
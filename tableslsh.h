@@ -0,0 +1,240 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_TABLESLSH_H
+#define SLASH_TABLESLSH_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "math.h"
+#include "slsh.h"
+#include "types.h"
+#include "mappedfile.h"
+
+namespace slash {
+
+// Class TableSLSH hashes binary feature vectors like SLSH, giving the very
+// same hashes, by table lookups instead of a loop over the set bits.
+//
+// For every rotation and byte position b, a table holds, for each of the
+// 256 values x of the byte, the sums of the rotation rows over the bits of
+// x, all d rows side by side. The dot products of a point with all d rows
+// of a rotation are then one contiguous load and add per nonzero byte of
+// the point, which the compiler vectorizes across the rows. The byte sums
+// are added in the same order as the Dot of the binary vectors, see
+// dotBytes, so the scores are bit for bit those of SLSH.
+//
+// The tables take 256*d/8 times the memory of the rotations, a fair trade
+// for d in the tens to low hundreds. HashProbes is left to the exact
+// rotations, which the hasher keeps.
+//
+// FeatureVector must provide the Words 64-bit words of its bits through
+// Word(w), like BitVector64 and BitVector; bits at d and above must be 0.
+template <class FeatureVector>
+class TableSLSH {
+	SLSH<FeatureVector> *exact;
+	// The sums for rotation m, byte position b and byte value x start at
+	// tables + ((m*nbytes + b)*256 + x)*stride.
+	float *tables;
+	size_t stride;  // d padded up to a cache line.
+	unsigned int hbits;
+	int d, k, l, nbytes;
+
+	TableSLSH(const TableSLSH&) = delete;
+	TableSLSH &operator=(const TableSLSH&) = delete;
+
+	// Layout of the head of a TableSLSH written by Write, followed by the
+	// exact SLSH. The tables are recomputed by Map.
+	struct header {
+		char magic[4];
+		uint32_t pad;
+	};
+
+	// Takes ownership of exact and builds the tables from its rotations.
+	explicit TableSLSH(SLSH<FeatureVector> *exact) : exact(exact) {
+		this->d = exact->D();
+		this->k = exact->K();
+		this->l = exact->L();
+		this->hbits = (unsigned int)ceil(log2(2.0*this->d));
+		this->stride = paddedFloats(this->d);
+		this->nbytes = (this->d + 7) / 8;
+		assert(this->d <= 64*FeatureVector::Words);
+
+		this->tables = alignedFloats((size_t)this->k*this->l*this->nbytes*256*this->stride);
+		for (int m=0; m<this->k*this->l; m++) {
+			for (int b=0; b<this->nbytes; b++) {
+				float *t = this->table(m, b, 0);
+				for (int r=0; r<this->d; r++) {
+					const float *u = exact->Row(m, r) + 8*b;
+					int bits = this->d - 8*b < 8 ? this->d - 8*b : 8;
+					// Adding the highest bit last gives the sum in increasing
+					// bit order, as in dotBytes.
+					for (int x=1; x<(1<<bits); x++) {
+						int high = 31 - __builtin_clz(x);
+						t[(size_t)x*this->stride + r] = t[(size_t)(x ^ (1<<high))*this->stride + r] + u[high];
+					}
+				}
+			}
+		}
+	}
+
+	inline float *table(int m, int b, int x) const {
+		return this->tables + (((size_t)m*this->nbytes + b)*256 + x)*this->stride;
+	}
+
+	// Hashes p into g, with stride floats of scratch space in dots.
+	void hash(const FeatureVector &p, float *dots, HashType *g) const {
+		uint8_t bytes[8*FeatureVector::Words];
+		for (int w=0; w<FeatureVector::Words; w++) {
+			uint64_t x = p.Word(w);
+			for (int j=0; j<8; j++) {
+				bytes[8*w + j] = (uint8_t)(x >> (8*j));
+			}
+		}
+
+		int m = 0;
+		for (int i=0; i<this->l; i++) {
+			g[i] = 0;
+			for (int j=0; j<this->k; j++, m++) {
+				memset(dots, 0, this->stride*sizeof(float));
+				for (int b=0; b<this->nbytes; b++) {
+					if (bytes[b] == 0) {
+						continue;
+					}
+					const float *t = this->table(m, b, bytes[b]);
+					for (size_t r=0; r<this->stride; r++) {
+						dots[r] += t[r];
+					}
+				}
+
+				// Same rule as SLSH::argmaxi.
+				int maxi = 0;
+				float max = 0;
+				for (int r=0; r<this->d; r++) {
+					float dot = dots[r];
+					float abs = dot>=0?dot:-dot;
+					if (abs < max) {
+						continue;
+					}
+					max = abs;
+					maxi = dot >= 0 ? r : r + this->d;
+				}
+				g[i] |= (HashType)maxi << (HashType)(this->hbits*j);
+			}
+		}
+	}
+
+public:
+	TableSLSH(int d, int k, int L) : TableSLSH(new SLSH<FeatureVector>(d, k, L)) {
+	}
+
+	TableSLSH(int d, int k, int L, uint64_t seed) : TableSLSH(new SLSH<FeatureVector>(d, k, L, seed)) {
+	}
+
+	static int MaxK(int d) {
+		return SLSH<FeatureVector>::MaxK(d);
+	}
+
+	inline int D() const {
+		return this->d;
+	}
+
+	// Returns k, after chopping it down to MaxK.
+	inline int K() const {
+		return this->k;
+	}
+
+	inline int L() const {
+		return this->l;
+	}
+
+	// Hashes a single point l times, storing the result in g. Same as SLSH::Hash.
+	void Hash(const FeatureVector &p, HashType *g) const {
+		float stack[1024];
+		std::vector<float> heap;
+		float *dots = stack;
+		if (this->stride > 1024) {
+			heap.resize(this->stride);
+			dots = heap.data();
+		}
+		this->hash(p, dots, g);
+	}
+
+	// Hashes n points, storing l consecutive hashes per point in g (n*l in total).
+	void HashBatch(const FeatureVector *points, size_t n, HashType *g) const {
+		std::vector<float> dots(this->stride);
+		for (size_t j=0; j<n; j++) {
+			this->hash(points[j], dots.data(), g + j*this->l);
+		}
+	}
+
+	// Returns the hash of p in table i alone, g[i] of Hash(p, g), with the
+	// exact rotations: a single table does not pay for building the sums.
+	HashType HashTable(const FeatureVector &p, int i) const {
+		return this->exact->HashTable(p, i);
+	}
+
+	// Same as SLSH::HashProbes, on the exact rotations.
+	void HashProbes(const FeatureVector &p, int probes, HashType *g) const {
+		this->exact->HashProbes(p, probes, g);
+	}
+
+	// Returns the exact hasher, which hashes identically.
+	const SLSH<FeatureVector> &Exact() const {
+		return *this->exact;
+	}
+
+	// Memory used by the tables in bytes, besides Exact().Bytes().
+	size_t Bytes() const {
+		return (size_t)this->k*this->l*this->nbytes*256*this->stride*sizeof(float);
+	}
+
+	// Appends the exact rotations to an index file. Returns false on error.
+	bool Write(FILE *f) const {
+		header h = {{'T', 'S', 'L', 'H'}, 0};
+		return writeAligned(f, &h, sizeof(h)) && this->exact->Write(f);
+	}
+
+	// Returns a TableSLSH built from the exact rotations written by Write at
+	// data, see SLSH::Map. Returns nullptr if data is malformed.
+	static TableSLSH *Map(const char *data, size_t size) {
+		size_t at = alignedSize(sizeof(header));
+		if (size < at || memcmp(data, "TSLH", 4) != 0) {
+			return nullptr;
+		}
+		SLSH<FeatureVector> *exact = SLSH<FeatureVector>::Map(data + at, size - at);
+		if (exact == nullptr) {
+			return nullptr;
+		}
+		if (exact->D() > 64*FeatureVector::Words) {
+			delete exact;
+			return nullptr;
+		}
+		return new TableSLSH(exact);
+	}
+
+	~TableSLSH() {
+		delete this->exact;
+		freeAligned(this->tables);
+	}
+};
+
+};
+
+#endif  // SLASH_TABLESLSH_H
@@ -0,0 +1,218 @@
+// slash - a locality sensitive hashing library.
+// Copyright (c) 2013 Utkan Güngördü <utkan@freeconsole.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SLASH_TUNER_H
+#define SLASH_TUNER_H
+
+#include <time.h>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <vector>
+#include "types.h"
+#include "frozenbin.h"
+#include "parallel.h"
+#include "querycontext.h"
+
+namespace slash {
+
+// What Tune looks for: the configuration with the least predicted query
+// latency reaching recall@limit of at least recall, within the budgets.
+struct TuneOptions {
+	int limit;  // number of neighbors per query.
+	double recall;  // target recall@limit.
+	double maxBytesPerPoint;  // memory budget of the index per point, not counting the hasher; 0 for none.
+	double maxLatency;  // latency budget of a query in seconds; 0 for none.
+	size_t points;  // number of points the index will hold; 0 for the size of the sample.
+	int maxK;  // largest k tried, further limited by Hasher::MaxK.
+	int maxL;  // largest L tried.
+	int maxProbes;  // largest number of probes per table tried; powers of two up to it are tried.
+	int threads;  // threads used for hashing the sample.
+
+	TuneOptions() : limit(10), recall(0.9), maxBytesPerPoint(0), maxLatency(0), points(0),
+		maxK(8), maxL(16), maxProbes(16), threads(1) {
+	}
+};
+
+// A configuration and its predicted performance.
+struct Tuning {
+	int k;
+	int l;
+	int probes;
+	double recall;  // recall@limit measured on the sample queries.
+	double candidates;  // points scored per query, scaled to TuneOptions::points.
+	double bytesPerPoint;  // memory of the index per point, not counting the hasher.
+	double latency;  // predicted seconds per query.
+	bool met;  // the recall target was reached within the budgets.
+};
+
+// Returns the tuning of the configuration with the least predicted latency
+// that reaches the recall target within the budgets of o. If there is none,
+// returns the one with the best recall within the budgets, with met unset;
+// if no configuration fits the budgets at all, k, l and probes are 0.
+//
+// The points and queries should be random samples of the data and of the
+// queries to come; the queries are not inserted. For every k a single
+// hasher with maxL tables hashes the points. The collisions of the queries
+// with the true neighbors in the first L tables give the recall of every L
+// at once, and the distinct points in the buckets probed give the number of
+// candidates. Candidates are scaled linearly to TuneOptions::points, as the
+// collision probability of a pair does not depend on the number of points.
+//
+// The latency is predicted from the hashing time of a query per table and
+// the scoring time of a candidate, both measured on the sample.
+//
+// Hasher must have a constructor taking (d, k, L), a static MaxK(d), and
+// the Hash, HashBatch and HashProbes functions used by LSH. Hashers are
+// drawn from rand, so seed it with srand for reproducible results.
+template <class FeatureVector, class Hasher>
+Tuning Tune(int d, const std::vector<FeatureVector> &points, const std::vector<FeatureVector> &queries, const TuneOptions &o) {
+	size_t n = points.size(), nq = queries.size();
+	int limit = o.limit < (int)n ? o.limit : (int)n;
+	double scale = o.points > 0 ? (double)o.points/(double)n : 1.0;
+	int threads = threadCount(o.threads);
+	int maxK = std::min(o.maxK, Hasher::MaxK(d));
+	int maxL = o.maxL;
+	std::vector<int> probes;
+	for (int p = 1; p <= o.maxProbes; p *= 2) {
+		probes.push_back(p);
+	}
+
+	Tuning best;
+	best.k = best.l = best.probes = 0;
+	best.recall = -1;
+	best.met = false;
+	if (n == 0 || nq == 0 || limit <= 0 || maxK < 1 || maxL < 1 || probes.empty()) {
+		return best;
+	}
+
+	auto now = []() {
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+	};
+
+	// Brute force: a point is a true neighbor of query q if it is at least as
+	// similar as the limit-th most similar point. Scoring the points in a
+	// random order also gives the cost of a candidate in a query.
+	std::vector<PointID> order(n);
+	std::vector<float> norms(n);
+	for (size_t j = 0; j < n; j++) {
+		order[j] = (PointID)j;
+		norms[j] = points[j].Norm();
+	}
+	std::shuffle(order.begin(), order.end(), std::default_random_engine(rand()));
+	std::vector<float> similarities(nq*n), shuffled(n), kth(nq);
+	double start = now();
+	for (size_t q = 0; q < nq; q++) {
+		FeatureVector::SimilarityBatch(queries[q], queries[q].Norm(), points.data(), norms.data(), order.data(), n, shuffled.data());
+		float *s = &similarities[q*n];
+		for (size_t j = 0; j < n; j++) {
+			s[order[j]] = shuffled[j];
+		}
+		std::copy(s, s + n, shuffled.begin());
+		std::nth_element(shuffled.begin(), shuffled.begin() + (limit - 1), shuffled.end(), std::greater<float>());
+		kth[q] = shuffled[limit - 1];
+	}
+	double perCandidate = (now() - start)/((double)nq*n);
+
+	std::vector<HashType> hashes(n*maxL), keys(n);
+	std::vector<PointID> ids(n);
+	std::vector<HashType> g((size_t)maxL*probes.back());
+	QueryContext c;
+
+	for (int k = 1; k <= maxK; k++) {
+		Hasher hasher(d, k, maxL);
+		parallelFor(threads, n, [&](size_t begin, size_t end) {
+			hasher.HashBatch(points.data() + begin, end - begin, hashes.data() + begin*maxL);
+		});
+		std::vector<frozenBin> bins(maxL);
+		std::vector<double> binBytes(maxL + 1);  // binBytes[L] is the memory of the first L tables.
+		for (int i = 0; i < maxL; i++) {
+			for (size_t j = 0; j < n; j++) {
+				keys[j] = hashes[j*maxL + i];
+				ids[j] = (PointID)j;
+			}
+			bins[i].Build(keys.data(), ids.data(), n);
+			binBytes[i+1] = binBytes[i] + (double)bins[i].Bytes();
+		}
+
+		for (int p: probes) {
+			// found[L-1] and candidates[L-1] accumulate over the queries the
+			// true neighbors and the points seen in the first L tables.
+			std::vector<double> found(maxL), candidates(maxL);
+			double hashing = 0;
+			for (size_t q = 0; q < nq; q++) {
+				start = now();
+				if (p > 1) {
+					hasher.HashProbes(queries[q], p, g.data());
+				} else {
+					hasher.Hash(queries[q], g.data());
+				}
+				hashing += now() - start;
+
+				const float *s = &similarities[q*n];
+				c.Reset(limit, n);
+				size_t good = 0, seen = 0;
+				for (int i = 0; i < maxL; i++) {
+					for (int t = 0; t < p; t++) {
+						size_t size;
+						const PointID *v = bins[i].Find(g[i*p + t], &size);
+						for (size_t j = 0; j < size; j++) {
+							if (c.Visit(v[j])) {
+								seen++;
+								good += s[v[j]] >= kth[q];
+							}
+						}
+					}
+					found[i] += (double)std::min(good, (size_t)limit)/(double)limit;
+					candidates[i] += (double)seen;
+				}
+			}
+
+			double perTable = hashing/((double)nq*maxL);
+			for (int l = 1; l <= maxL; l++) {
+				Tuning t;
+				t.k = k;
+				t.l = l;
+				t.probes = p;
+				t.recall = found[l-1]/(double)nq;
+				t.candidates = scale*candidates[l-1]/(double)nq;
+				t.bytesPerPoint = (double)sizeof(FeatureVector) + sizeof(float) + l*sizeof(HashType) + binBytes[l]/(double)n;
+				t.latency = l*perTable + t.candidates*perCandidate;
+				t.met = t.recall >= o.recall;
+
+				if ((o.maxBytesPerPoint > 0 && t.bytesPerPoint > o.maxBytesPerPoint) ||
+					(o.maxLatency > 0 && t.latency > o.maxLatency)) {
+					continue;
+				}
+				bool better = t.met ? !best.met || t.latency < best.latency : !best.met && t.recall > best.recall;
+				if (better) {
+					best = t;
+				}
+			}
+		}
+	}
+
+	if (best.recall < 0) {
+		best.recall = 0;
+	}
+	return best;
+}
+
+};
+
+#endif  // SLASH_TUNER_H
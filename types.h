@@ -17,11 +17,26 @@
 #ifndef SLASH_TYPES_H
 #define SLASH_TYPES_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 namespace slash {
 
 typedef uint64_t HashType;
 const size_t HashBits = 64;
 
+// Dense id of an inserted point.
+typedef uint32_t PointID;
+const PointID MaxPointID = UINT32_MAX;  // Not a valid id.
+
+// Size of a cache line in bytes. Hot arrays are aligned to and padded up to this.
+const size_t CacheLine = 64;
+
+// Returns n rounded up to a whole number of cache lines.
+inline size_t alignedSize(size_t n) {
+	return (n + CacheLine - 1) / CacheLine * CacheLine;
+}
+
 };
 
 #endif  // SLASH_TYPES_H